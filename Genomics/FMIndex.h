@@ -0,0 +1,604 @@
+//
+//  FMIndex.h
+//  Project4
+//
+//  An FM-index over a set of DNA sequences: the Burrows-Wheeler transform of
+//  their concatenation, with rank counts and a sampled suffix array, in about
+//  six bits per base. Unlike a k-mer trie it doesn't depend on the key
+//  length, so keys of any length can be looked up in the one index.
+//
+
+#ifndef FMINDEX_INCLUDED
+#define FMINDEX_INCLUDED
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+class FMIndex
+{
+public:
+    FMIndex();
+    // Indexes the sequences, replacing anything indexed before. Only A, C, G,
+    // T and N can be found; any other character is treated like the gap
+    // between two sequences, which no key matches.
+    void build(const std::vector<std::string>& sequences);
+
+    // Calls visit(sequence, position) for every place key[0, length) occurs,
+    // or, if exactMatchOnly is false, occurs with at most one mismatch after
+    // its first base. Hits come in the order a trie of every k-mer, inserted
+    // sequence by sequence, would give them: by the matching k-mer in A, C, G,
+    // T, N order, then by sequence and position. visit returns false to stop
+    // the search, in which case find returns false.
+    template<typename Visit>
+    bool find(const char* key, int length, bool exactMatchOnly, Visit visit) const;
+    // The same, for a search with a budget: a k-mer's rows are only located
+    // while wanted(n), given how many of them have been, says more are
+    // wanted. Its hits that were located are visited in order, the rest
+    // skipped, so a repetitive k-mer costs no more than the budget allows.
+    template<typename Visit, typename Wanted>
+    bool find(const char* key, int length, bool exactMatchOnly, Visit visit, Wanted wanted) const;
+
+    // Index images, as for Trie: save() writes a flat block that attach() can
+    // use in place (e.g. out of a memory-mapped file) while it stays valid.
+    void save(std::ostream& out) const;
+    bool attach(const char* image, size_t size);
+
+    FMIndex(const FMIndex&) = delete;
+    FMIndex& operator=(const FMIndex&) = delete;
+private:
+    // Symbols of the indexed text: the end, the gap after each sequence (and
+    // any character we don't index), then the bases.
+    enum { kEnd = 0, kGap = 1, kFirstBase = 2, kSymbols = 7 };
+    static const int kBlockRows = 128;  // BWT rows per rank block
+    static const int kSuperblockRows = 65536; // BWT rows per superblock, so counts within one fit 16 bits
+    static const int kSampleRate = 32;  // text positions between suffix array samples
+
+    // 128 rows of the BWT in 80 bytes (5 bits a row): 3 bit planes for the
+    // symbols, and counts up to the block from the start of its superblock.
+    struct Block
+    {
+        uint16_t m_before[kSymbols]; // occurrences of each symbol in earlier blocks of the superblock
+        uint16_t m_sampledBefore;    // sampled rows in earlier blocks of the superblock
+        uint64_t m_planes[3][2];
+        uint64_t m_sampled[2];       // rows whose suffix array entry is kept
+    };
+
+    struct Superblock // counts up to each run of kSuperblockRows rows
+    {
+        uint32_t m_before[kSymbols];
+        uint32_t m_sampledBefore;
+    };
+
+    struct ImageHeader
+    {
+        uint64_t m_rows;
+        uint64_t m_sequenceCount;
+        uint64_t m_sampleCount;
+        uint32_t m_blockSize;
+        uint32_t m_symbolStarts[kSymbols + 1];
+    };
+
+    struct Range // BWT rows [m_first, m_last)
+    {
+        uint32_t m_first;
+        uint32_t m_last;
+    };
+
+    static int symbolOf(char c);
+    static size_t blockCount(uint64_t rows) { return rows == 0 ? 0 : rows / kBlockRows + 1; }
+    static size_t superblockCount(uint64_t rows) { return rows == 0 ? 0 : rows / kSuperblockRows + 1; }
+    static size_t imageAlign(size_t bytes) { return (bytes + 7) & ~(size_t) 7; }
+    template<typename Symbol>
+    static void suffixArray(const Symbol* text, int32_t* sa, int n, int alphabet);
+
+    int symbolAt(uint32_t row) const;
+    uint32_t occurrences(int symbol, uint32_t row) const; // of symbol in rows [0, row)
+    bool extend(Range& range, int symbol) const;           // prepend symbol to the range's keys
+    uint32_t locate(uint32_t row) const;                   // text position of the row's suffix
+    uint32_t sampledBefore(uint32_t row) const;            // sampled rows in [0, row)
+    bool exactRange(const char* key, int length, Range& range) const;
+
+    uint32_t m_rows; // length of the text, the end included
+    uint32_t m_symbolStarts[kSymbols + 1]; // first row of the suffixes starting with each symbol
+    std::vector<Block> m_ownedBlocks;
+    std::vector<Superblock> m_ownedSuperblocks;
+    std::vector<uint32_t> m_ownedSamples;
+    std::vector<uint32_t> m_ownedStarts;
+    const Block* m_blocks;      // the owned vectors', or an attached image's
+    const Superblock* m_superblocks;
+    const uint32_t* m_samples;
+    const uint32_t* m_starts;   // where each sequence begins in the text
+    uint32_t m_sequenceCount;
+};
+
+inline FMIndex::FMIndex() : m_rows(0), m_blocks(nullptr), m_superblocks(nullptr), m_samples(nullptr), m_starts(nullptr), m_sequenceCount(0)
+{
+    std::fill(m_symbolStarts, m_symbolStarts + kSymbols + 1, 0);
+}
+
+inline int FMIndex::symbolOf(char c)
+{
+    switch (c)
+    {
+        case 'A': return kFirstBase;
+        case 'C': return kFirstBase + 1;
+        case 'G': return kFirstBase + 2;
+        case 'T': return kFirstBase + 3;
+        case 'N': return kFirstBase + 4;
+        default: return kGap;
+    }
+}
+
+// SA-IS (Nong, Zhang and Chan): sorts the suffixes of text[0, n) in linear
+// time. text[n - 1] must be 0 and appear nowhere else.
+template<typename Symbol>
+void FMIndex::suffixArray(const Symbol* text, int32_t* sa, int n, int alphabet)
+{
+    if (n == 1)
+    {
+        sa[0] = 0;
+        return;
+    }
+    std::vector<char> small(n); // S-type suffixes: smaller than the suffix after them
+    small[n - 1] = true;
+    small[n - 2] = false;
+    for (int i = n - 3; i >= 0; i--)
+    {
+        small[i] = text[i] < text[i + 1] || (text[i] == text[i + 1] && small[i + 1]);
+    }
+    auto isLMS = [&](int i) { return i > 0 && small[i] && !small[i - 1]; };
+    std::vector<int> bucket(alphabet);
+    auto bucketEdges = [&](bool ends)
+    {
+        std::fill(bucket.begin(), bucket.end(), 0);
+        for (int i = 0; i < n; i++)
+        {
+            bucket[text[i]]++;
+        }
+        for (int c = 0, sum = 0; c < alphabet; c++)
+        {
+            sum += bucket[c];
+            bucket[c] = ends ? sum : sum - bucket[c];
+        }
+    };
+    auto induce = [&]()
+    {
+        bucketEdges(false);
+        for (int i = 0; i < n; i++)
+        {
+            int j = sa[i] - 1;
+            if (sa[i] > 0 && !small[j])
+            {
+                sa[bucket[text[j]]++] = j;
+            }
+        }
+        bucketEdges(true);
+        for (int i = n - 1; i >= 0; i--)
+        {
+            int j = sa[i] - 1;
+            if (sa[i] > 0 && small[j])
+            {
+                sa[--bucket[text[j]]] = j;
+            }
+        }
+    };
+
+    // sort the LMS substrings
+    bucketEdges(true);
+    std::fill(sa, sa + n, -1);
+    for (int i = 1; i < n; i++)
+    {
+        if (isLMS(i))
+        {
+            sa[--bucket[text[i]]] = i;
+        }
+    }
+    induce();
+
+    // name them, equal substrings getting equal names, into a reduced string
+    int lmsCount = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (isLMS(sa[i]))
+        {
+            sa[lmsCount++] = sa[i];
+        }
+    }
+    std::fill(sa + lmsCount, sa + n, -1);
+    int names = 0;
+    int previous = -1;
+    for (int i = 0; i < lmsCount; i++)
+    {
+        int position = sa[i];
+        bool differs = previous < 0;
+        for (int d = 0; !differs; d++)
+        {
+            if (text[position + d] != text[previous + d] || small[position + d] != small[previous + d])
+            {
+                differs = true;
+            }
+            else if (d > 0 && (isLMS(position + d) || isLMS(previous + d)))
+            {
+                break;
+            }
+        }
+        if (differs)
+        {
+            names++;
+            previous = position;
+        }
+        sa[lmsCount + position / 2] = names - 1;
+    }
+    for (int i = n - 1, j = n - 1; i >= lmsCount; i--)
+    {
+        if (sa[i] >= 0)
+        {
+            sa[j--] = sa[i];
+        }
+    }
+
+    // sort the reduced string's suffixes, recursing unless every name is unique
+    int32_t* reduced = sa + n - lmsCount;
+    int32_t* reducedSA = sa;
+    if (names < lmsCount)
+    {
+        suffixArray(reduced, reducedSA, lmsCount, names);
+    }
+    else
+    {
+        for (int i = 0; i < lmsCount; i++)
+        {
+            reducedSA[reduced[i]] = i;
+        }
+    }
+
+    // which orders the LMS suffixes, and from them all the others
+    for (int i = 1, j = 0; i < n; i++)
+    {
+        if (isLMS(i))
+        {
+            reduced[j++] = i;
+        }
+    }
+    for (int i = 0; i < lmsCount; i++)
+    {
+        reducedSA[i] = reduced[reducedSA[i]];
+    }
+    std::fill(sa + lmsCount, sa + n, -1);
+    bucketEdges(true);
+    for (int i = lmsCount - 1; i >= 0; i--)
+    {
+        int j = sa[i];
+        sa[i] = -1;
+        sa[--bucket[text[j]]] = j;
+    }
+    induce();
+}
+
+inline void FMIndex::build(const std::vector<std::string>& sequences)
+{
+    // the text is every sequence followed by a gap, then the end
+    std::vector<unsigned char> text;
+    m_ownedStarts.clear();
+    for (int s = 0; s < sequences.size(); s++)
+    {
+        m_ownedStarts.push_back((uint32_t) text.size());
+        for (int i = 0; i < sequences[s].size(); i++)
+        {
+            text.push_back((unsigned char) symbolOf(sequences[s][i]));
+        }
+        text.push_back(kGap);
+    }
+    text.push_back(kEnd);
+    m_rows = (uint32_t) text.size();
+    m_sequenceCount = (uint32_t) sequences.size();
+
+    std::vector<int32_t> sa(m_rows);
+    suffixArray(text.data(), sa.data(), (int) m_rows, kSymbols);
+
+    uint32_t counts[kSymbols] = { 0 };
+    for (uint32_t i = 0; i < m_rows; i++)
+    {
+        counts[text[i]]++;
+    }
+    m_symbolStarts[0] = 0;
+    for (int c = 0; c < kSymbols; c++)
+    {
+        m_symbolStarts[c + 1] = m_symbolStarts[c] + counts[c];
+    }
+
+    // the BWT, a block at a time, with the running counts and samples
+    m_ownedBlocks.assign(blockCount(m_rows), Block());
+    m_ownedSuperblocks.assign(superblockCount(m_rows), Superblock());
+    m_ownedSamples.clear();
+    std::fill(counts, counts + kSymbols, 0);
+    uint32_t sampled = 0;
+    for (uint32_t row = 0; row <= m_rows; row++)
+    {
+        Block& block = m_ownedBlocks[row / kBlockRows];
+        Superblock& superblock = m_ownedSuperblocks[row / kSuperblockRows];
+        if (row % kSuperblockRows == 0)
+        {
+            std::copy(counts, counts + kSymbols, superblock.m_before);
+            superblock.m_sampledBefore = sampled;
+        }
+        if (row % kBlockRows == 0)
+        {
+            for (int c = 0; c < kSymbols; c++)
+            {
+                block.m_before[c] = (uint16_t) (counts[c] - superblock.m_before[c]);
+            }
+            block.m_sampledBefore = (uint16_t) (sampled - superblock.m_sampledBefore);
+        }
+        if (row == m_rows)
+        {
+            break;
+        }
+        int symbol = sa[row] > 0 ? (int) text[sa[row] - 1] : (int) kEnd;
+        int bit = row % kBlockRows;
+        for (int plane = 0; plane < 3; plane++)
+        {
+            if (symbol & (1 << plane))
+            {
+                block.m_planes[plane][bit / 64] |= (uint64_t) 1 << (bit % 64);
+            }
+        }
+        counts[symbol]++;
+        if (sa[row] % kSampleRate == 0)
+        {
+            block.m_sampled[bit / 64] |= (uint64_t) 1 << (bit % 64);
+            m_ownedSamples.push_back((uint32_t) sa[row]);
+            sampled++;
+        }
+    }
+    m_blocks = m_ownedBlocks.data();
+    m_superblocks = m_ownedSuperblocks.data();
+    m_samples = m_ownedSamples.data();
+    m_starts = m_ownedStarts.data();
+}
+
+inline int FMIndex::symbolAt(uint32_t row) const
+{
+    const Block& block = m_blocks[row / kBlockRows];
+    int bit = row % kBlockRows;
+    int symbol = 0;
+    for (int plane = 0; plane < 3; plane++)
+    {
+        symbol |= (int) ((block.m_planes[plane][bit / 64] >> (bit % 64)) & 1) << plane;
+    }
+    return symbol;
+}
+
+inline uint32_t FMIndex::occurrences(int symbol, uint32_t row) const
+{
+    const Block& block = m_blocks[row / kBlockRows];
+    uint32_t count = m_superblocks[row / kSuperblockRows].m_before[symbol] + block.m_before[symbol];
+    int left = row % kBlockRows;
+    for (int word = 0; left > 0; word++, left -= 64)
+    {
+        uint64_t match = ~(uint64_t) 0; // rows in this word holding symbol
+        for (int plane = 0; plane < 3; plane++)
+        {
+            match &= (symbol & (1 << plane)) ? block.m_planes[plane][word] : ~block.m_planes[plane][word];
+        }
+        if (left < 64)
+        {
+            match &= ((uint64_t) 1 << left) - 1;
+        }
+        count += (uint32_t) __builtin_popcountll(match);
+    }
+    return count;
+}
+
+inline bool FMIndex::extend(Range& range, int symbol) const
+{
+    range.m_first = m_symbolStarts[symbol] + occurrences(symbol, range.m_first);
+    range.m_last = m_symbolStarts[symbol] + occurrences(symbol, range.m_last);
+    return range.m_first < range.m_last;
+}
+
+inline uint32_t FMIndex::locate(uint32_t row) const
+{
+    // step back through the text until reaching a sampled position
+    uint32_t steps = 0;
+    for (;;)
+    {
+        const Block& block = m_blocks[row / kBlockRows];
+        int bit = row % kBlockRows;
+        if ((block.m_sampled[bit / 64] >> (bit % 64)) & 1)
+        {
+            return m_samples[sampledBefore(row)] + steps;
+        }
+        int symbol = symbolAt(row);
+        row = m_symbolStarts[symbol] + occurrences(symbol, row);
+        steps++;
+    }
+}
+
+inline uint32_t FMIndex::sampledBefore(uint32_t row) const
+{
+    const Block& block = m_blocks[row / kBlockRows];
+    int bit = row % kBlockRows;
+    uint32_t rank = m_superblocks[row / kSuperblockRows].m_sampledBefore + block.m_sampledBefore;
+    if (bit >= 64)
+    {
+        rank += (uint32_t) __builtin_popcountll(block.m_sampled[0]);
+    }
+    return rank + (uint32_t) __builtin_popcountll(block.m_sampled[bit / 64] & (((uint64_t) 1 << (bit % 64)) - 1));
+}
+
+inline bool FMIndex::exactRange(const char* key, int length, Range& range) const
+{
+    range.m_first = 0;
+    range.m_last = m_rows;
+    for (int i = length - 1; i >= 0; i--)
+    {
+        int symbol = symbolOf(key[i]);
+        if (symbol == kGap || !extend(range, symbol))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename Visit>
+bool FMIndex::find(const char* key, int length, bool exactMatchOnly, Visit visit) const
+{
+    return find(key, length, exactMatchOnly, visit, [](long long) { return true; });
+}
+
+template<typename Visit, typename Wanted>
+bool FMIndex::find(const char* key, int length, bool exactMatchOnly, Visit visit, Wanted wanted) const
+{
+    if (m_rows == 0 || length <= 0)
+    {
+        return true;
+    }
+    // a variant of the key: base at position m_at swapped for m_symbol (m_at
+    // == length for the key itself), and the rows of its occurrences
+    struct Variant
+    {
+        int m_at;
+        int m_symbol;
+        Range m_rows;
+    };
+    std::vector<Variant> variants;
+    Range exact;
+    if (exactRange(key, length, exact))
+    {
+        variants.push_back(Variant{ length, 0, exact });
+    }
+    if (!exactMatchOnly)
+    {
+        // suffixes[i]: the rows matching key[i, length) exactly
+        std::vector<Range> suffixes(length + 1);
+        suffixes[length] = Range{ 0, m_rows };
+        int matched = length; // key[matched, length) occurs
+        while (matched > 0)
+        {
+            Range range = suffixes[matched];
+            int symbol = symbolOf(key[matched - 1]);
+            if (symbol == kGap || !extend(range, symbol))
+            {
+                break;
+            }
+            suffixes[--matched] = range;
+        }
+        for (int at = std::max(1, matched - 1); at < length; at++) // the first base always has to match
+        {
+            for (int symbol = kFirstBase; symbol < kSymbols; symbol++)
+            {
+                Range range = suffixes[at + 1];
+                if (symbol == symbolOf(key[at]) || !extend(range, symbol))
+                {
+                    continue;
+                }
+                int i = at - 1;
+                for (; i >= 0; i--)
+                {
+                    int before = symbolOf(key[i]);
+                    if (before == kGap || !extend(range, before))
+                    {
+                        break;
+                    }
+                }
+                if (i < 0)
+                {
+                    variants.push_back(Variant{ at, symbol, range });
+                }
+            }
+        }
+        // in k-mer order: two variants first differ where the earlier swap is
+        std::sort(variants.begin(), variants.end(), [key](const Variant& x, const Variant& y)
+        {
+            if (x.m_at == y.m_at)
+            {
+                return x.m_symbol < y.m_symbol;
+            }
+            const Variant& first = x.m_at < y.m_at ? x : y;
+            bool firstIsSmaller = first.m_symbol < symbolOf(key[first.m_at]);
+            return x.m_at < y.m_at ? firstIsSmaller : !firstIsSmaller;
+        });
+    }
+
+    std::vector<uint32_t> positions;
+    for (int v = 0; v < variants.size(); v++)
+    {
+        positions.clear();
+        for (uint32_t row = variants[v].m_rows.m_first; row < variants[v].m_rows.m_last && wanted((long long) positions.size()); row++)
+        {
+            positions.push_back(locate(row));
+        }
+        std::sort(positions.begin(), positions.end());
+        int sequence = 0;
+        for (int p = 0; p < positions.size(); p++)
+        {
+            while (sequence + 1 < m_sequenceCount && m_starts[sequence + 1] <= positions[p])
+            {
+                sequence++;
+            }
+            if (!visit(sequence, (int) (positions[p] - m_starts[sequence])))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+inline void FMIndex::save(std::ostream& out) const
+{
+    static const char padding[8] = { 0 };
+    ImageHeader header = ImageHeader();
+    header.m_rows = m_rows;
+    header.m_sequenceCount = m_sequenceCount;
+    header.m_sampleCount = m_rows == 0 ? 0 : sampledBefore(m_rows);
+    header.m_blockSize = sizeof(Block);
+    std::copy(m_symbolStarts, m_symbolStarts + kSymbols + 1, header.m_symbolStarts);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(padding, imageAlign(sizeof(header)) - sizeof(header));
+    out.write(reinterpret_cast<const char*>(m_blocks), blockCount(m_rows) * sizeof(Block));
+    out.write(reinterpret_cast<const char*>(m_superblocks), superblockCount(m_rows) * sizeof(Superblock));
+    out.write(reinterpret_cast<const char*>(m_samples), header.m_sampleCount * sizeof(uint32_t));
+    out.write(padding, imageAlign(header.m_sampleCount * sizeof(uint32_t)) - header.m_sampleCount * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char*>(m_starts), m_sequenceCount * sizeof(uint32_t));
+    out.write(padding, imageAlign(m_sequenceCount * sizeof(uint32_t)) - m_sequenceCount * sizeof(uint32_t));
+}
+
+inline bool FMIndex::attach(const char* image, size_t size)
+{
+    ImageHeader header;
+    if (size < imageAlign(sizeof(header)))
+    {
+        return false;
+    }
+    std::memcpy(&header, image, sizeof(header));
+    size_t blockBytes = blockCount(header.m_rows) * sizeof(Block) + superblockCount(header.m_rows) * sizeof(Superblock);
+    size_t sampleBytes = imageAlign(header.m_sampleCount * sizeof(uint32_t));
+    size_t startBytes = imageAlign(header.m_sequenceCount * sizeof(uint32_t));
+    if (header.m_blockSize != sizeof(Block) || header.m_rows > UINT32_MAX || header.m_sampleCount > header.m_rows ||
+        header.m_sequenceCount > header.m_rows || size < imageAlign(sizeof(header)) + blockBytes + sampleBytes + startBytes)
+    {
+        return false; // written by a different build, or cut short
+    }
+    const char* blocks = image + imageAlign(sizeof(header));
+    m_ownedBlocks.clear();
+    m_ownedSuperblocks.clear();
+    m_ownedSamples.clear();
+    m_ownedStarts.clear();
+    m_rows = (uint32_t) header.m_rows;
+    m_sequenceCount = (uint32_t) header.m_sequenceCount;
+    std::copy(header.m_symbolStarts, header.m_symbolStarts + kSymbols + 1, m_symbolStarts);
+    m_blocks = reinterpret_cast<const Block*>(blocks);
+    m_superblocks = reinterpret_cast<const Superblock*>(blocks + blockCount(header.m_rows) * sizeof(Block));
+    m_samples = reinterpret_cast<const uint32_t*>(blocks + blockBytes);
+    m_starts = reinterpret_cast<const uint32_t*>(blocks + blockBytes + sampleBytes);
+    return true;
+}
+
+#endif // FMINDEX_INCLUDED
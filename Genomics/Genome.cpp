@@ -6,53 +6,485 @@
 //  Copyright © 2019 Ayesha Kumbhare. All rights reserved.
 //
 #include "provided.h"
+#include "MappedFile.h"
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <sstream>
+#include <sys/stat.h>
 //using namespace std;
 
+// The sequence is kept 2 bits per base, 32 bases to a word. Bases other than
+// A, C, G and T pack as A and are recorded exactly in a sorted list of runs,
+// which for real genomes is a handful of stretches of N. A genome from an
+// indexed FASTA file instead reads its bases out of the mapped file, and one
+// from an index image uses the words and runs saved there in place.
 class GenomeImpl
 {
 public:
     GenomeImpl(const std::string& nm, const std::string& sequence);
+    GenomeImpl(const std::string& nm, const std::shared_ptr<const MappedFile>& file, size_t offset, int length, int lineBases, int lineWidth);
     static bool load(std::istream& genomeSource, std::vector<Genome>& genomes);
+    static bool loadIndexed(const std::string& filename, std::vector<Genome>& genomes);
+    GenomeImpl(const GenomeImpl&) = delete; // m_words may point into m_packed
+    GenomeImpl& operator=(const GenomeImpl&) = delete;
+    static std::shared_ptr<const GenomeImpl> attachImage(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, size_t offset, size_t size);
+    size_t imageSize() const;
+    void saveImage(std::ostream& out) const;
     int length() const;
     std::string name() const;
     bool extract(int position, int length, std::string& fragment) const;
+    uint64_t packedWord(int position) const;
+    bool containsN(int position, int length) const;
 private:
+    struct BaseRun // m_length copies of m_base starting at m_start
+    {
+        int m_start;
+        int m_length;
+        char m_base;
+    };
+    GenomeImpl(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, const uint64_t* words, const BaseRun* runs, const BaseRun* runsEnd);
+    const BaseRun* firstRunEndingAfter(int position) const;
+    bool copyMapped(int position, int length, char* out) const;
+    
     std::string m_name;
-    std::string m_sequence;
+    int m_length;
+    std::vector<uint64_t> m_packed; // bases past m_length are left as 0
+    std::vector<BaseRun> m_runs;
+    const uint64_t* m_words; // m_packed's words, or an index image's
+    const BaseRun* m_runsBegin; // likewise m_runs, or an index image's
+    const BaseRun* m_runsEnd;
+    std::shared_ptr<const MappedFile> m_image; // the index image m_words is in, if it is
+    std::shared_ptr<const MappedFile> m_file; // set (and m_words left null) for a genome read from an indexed file
+    size_t m_offset; // where its first base is in the file
+    int m_lineBases; // bases on each full line
+    int m_lineWidth; // bytes in each full line, the newline included
     
 };
 
+namespace
+{
+    const char kPackedBases[4] = { 'A', 'C', 'G', 'T' };
+    
+    struct BaseCodes // packed code for each character, -1 for anything but A, C, G, T
+    {
+        BaseCodes()
+        {
+            std::fill(m_code, m_code + 256, -1);
+            for (int b = 0; b < 4; b++)
+            {
+                m_code[(unsigned char) kPackedBases[b]] = b;
+            }
+        }
+        signed char m_code[256];
+    };
+    
+    const BaseCodes& baseCodes() // built on first use, so genomes made during static initialization work too
+    {
+        static const BaseCodes codes;
+        return codes;
+    }
+    
+    struct PackedBytes // the four bases each packed byte spells out
+    {
+        PackedBytes()
+        {
+            for (int byte = 0; byte < 256; byte++)
+            {
+                for (int b = 0; b < 4; b++)
+                {
+                    m_bases[byte][b] = kPackedBases[(byte >> (2 * b)) & 3];
+                }
+            }
+        }
+        char m_bases[256][4];
+    };
+    
+    const PackedBytes& packedBytes()
+    {
+        static const PackedBytes bytes;
+        return bytes;
+    }
+    
+    struct FastaBases // what each character adds to a sequence: its uppercase base, or 0 if it isn't one
+    {
+        FastaBases()
+        {
+            std::fill(m_base, m_base + 256, 0);
+            const char bases[] = "ACGTN";
+            for (int b = 0; bases[b] != '\0'; b++)
+            {
+                m_base[(unsigned char) bases[b]] = bases[b];
+                m_base[(unsigned char) tolower(bases[b])] = bases[b];
+            }
+        }
+        char m_base[256];
+    };
+    
+    const FastaBases& fastaBases()
+    {
+        static const FastaBases bases;
+        return bases;
+    }
+    
+    // Hands out a stream's contents a large block at a time, instead of a
+    // character at a time through istream::get.
+    class BlockReader
+    {
+    public:
+        BlockReader(std::istream& source) : m_source(source), m_block(1 << 20), m_next(nullptr), m_end(nullptr) {}
+        bool more() // is there anything left? reads the next block if need be
+        {
+            if (m_next == m_end)
+            {
+                m_source.read(m_block.data(), m_block.size());
+                m_next = m_block.data();
+                m_end = m_next + m_source.gcount();
+            }
+            return m_next != m_end;
+        }
+        std::string getline() // the rest of the line, like std::getline
+        {
+            std::string line;
+            while (more())
+            {
+                const char* newline = static_cast<const char*>(memchr(m_next, '\n', m_end - m_next));
+                line.append(m_next, newline != nullptr ? newline : m_end);
+                if (newline != nullptr)
+                {
+                    m_next = newline + 1;
+                    break;
+                }
+                m_next = m_end;
+            }
+            return line;
+        }
+        size_t remaining() // bytes left in the stream if it can tell us, otherwise 0
+        {
+            std::streampos here = m_source.tellg();
+            if (here == std::streampos(-1) || !m_source.seekg(0, std::ios::end))
+            {
+                m_source.clear();
+                return 0;
+            }
+            std::streampos last = m_source.tellg();
+            m_source.seekg(here);
+            return last > here ? (size_t) (last - here) : 0;
+        }
+        
+        std::istream& m_source;
+        std::vector<char> m_block;
+        const char* m_next; // the unread part of the block
+        const char* m_end;
+    };
+    
+    struct FastaRecord // one line of a .fai index
+    {
+        std::string m_name;
+        int m_length;
+        size_t m_offset; // of the first base
+        int m_lineBases;
+        int m_lineWidth;
+    };
+    
+    // Works out where each record's bases are. Only files that load would
+    // accept unchanged, and whose records have every line but the last the
+    // same length, can be read this way; for anything else this fails.
+    bool indexFasta(const MappedFile& file, std::vector<FastaRecord>& records)
+    {
+        const FastaBases& fasta = fastaBases();
+        const char* data = file.data();
+        size_t size = file.size();
+        size_t pos = 0;
+        if (size == 0)
+        {
+            return false;
+        }
+        while (pos < size)
+        {
+            if (data[pos] != '>')
+            {
+                return false;
+            }
+            const char* newline = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+            if (newline == nullptr)
+            {
+                return false;
+            }
+            FastaRecord record;
+            record.m_name.assign(data + pos + 1, newline);
+            if (record.m_name.empty() || record.m_name.find('\t') != std::string::npos)
+            {
+                return false;
+            }
+            pos = newline - data + 1;
+            record.m_offset = pos;
+            size_t length = 0;
+            int lineBases = 0;
+            bool shortLine = false; // only the last line may be shorter than the first
+            while (pos < size && data[pos] != '>')
+            {
+                const char* end = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+                if (end == nullptr)
+                {
+                    end = data + size;
+                }
+                int bases = (int) (end - (data + pos));
+                if (bases == 0 || bases > 80 || shortLine || (lineBases != 0 && bases > lineBases))
+                {
+                    return false;
+                }
+                for (const char* c = data + pos; c < end; c++)
+                {
+                    if (fasta.m_base[(unsigned char) *c] == 0)
+                    {
+                        return false;
+                    }
+                }
+                if (lineBases == 0)
+                {
+                    lineBases = bases;
+                }
+                shortLine = bases < lineBases;
+                length += bases;
+                pos = end - data + 1;
+            }
+            if (length == 0 || length > INT_MAX)
+            {
+                return false;
+            }
+            record.m_length = (int) length;
+            record.m_lineBases = lineBases;
+            record.m_lineWidth = lineBases + 1;
+            records.push_back(record);
+        }
+        return true;
+    }
+    
+    // Was filename changed after indexName was written? Anything that can't
+    // be checked counts as changed.
+    bool changedSince(const std::string& filename, const std::string& indexName)
+    {
+        struct stat file, index;
+        return stat(filename.c_str(), &file) != 0 || stat(indexName.c_str(), &index) != 0 || file.st_mtime > index.st_mtime;
+    }
+    
+    // Reads a saved index, checking that it still fits the file it describes:
+    // the file mustn't be newer than the index, and the records must cover the
+    // whole file, each a header line naming it followed by lines that end
+    // exactly where the index says. The bases themselves are only checked as
+    // they're read.
+    bool readFastaIndex(const std::string& indexName, const std::string& filename, const MappedFile& file, std::vector<FastaRecord>& records)
+    {
+        if (changedSince(filename, indexName))
+        {
+            return false;
+        }
+        std::ifstream index(indexName);
+        std::string line;
+        const char* data = file.data();
+        size_t header = 0; // where the next record's header line should start
+        while (getline(index, line))
+        {
+            size_t tab = line.find('\t');
+            if (tab == 0 || tab == std::string::npos)
+            {
+                return false;
+            }
+            FastaRecord record;
+            record.m_name = line.substr(0, tab);
+            std::istringstream fields(line.substr(tab + 1));
+            if (!(fields >> record.m_length >> record.m_offset >> record.m_lineBases >> record.m_lineWidth) ||
+                record.m_length <= 0 || record.m_lineBases <= 0 || record.m_lineWidth != record.m_lineBases + 1 ||
+                record.m_offset != header + record.m_name.size() + 2 || record.m_offset > file.size() || data[header] != '>' ||
+                data[record.m_offset - 1] != '\n' || record.m_name.compare(0, std::string::npos, data + header + 1, record.m_name.size()) != 0)
+            {
+                return false;
+            }
+            int lines = (record.m_length - 1) / record.m_lineBases + 1;
+            int lastBases = record.m_length - (lines - 1) * record.m_lineBases;
+            size_t lastLine = record.m_offset + (size_t) (lines - 1) * record.m_lineWidth;
+            if (lastLine + lastBases > file.size())
+            {
+                return false;
+            }
+            for (size_t newline = record.m_offset + record.m_lineBases; newline < lastLine; newline += record.m_lineWidth)
+            {
+                if (data[newline] != '\n')
+                {
+                    return false;
+                }
+            }
+            header = lastLine + lastBases;
+            if (header < file.size() && data[header++] != '\n')
+            {
+                return false;
+            }
+            records.push_back(record);
+        }
+        return !records.empty() && header == file.size();
+    }
+    
+    void writeFastaIndex(const std::string& indexName, const std::vector<FastaRecord>& records)
+    {
+        std::ofstream index(indexName);
+        for (int i = 0; i < records.size(); i++)
+        {
+            const FastaRecord& r = records[i];
+            index << r.m_name << '\t' << r.m_length << '\t' << r.m_offset << '\t' << r.m_lineBases << '\t' << r.m_lineWidth << '\n';
+        }
+    }
+}
+
 GenomeImpl::GenomeImpl(const std::string& nm, const std::string& sequence) // constructor
+: m_offset(0), m_lineBases(0), m_lineWidth(0)
 {
     m_name = nm;
-    m_sequence = sequence;
+    m_length = (int) sequence.size();
+    m_packed.assign((m_length + 31) / 32, 0);
+    const BaseCodes& codes = baseCodes();
+    for (int i = 0; i < m_length; i++)
+    {
+        int code = codes.m_code[(unsigned char) sequence[i]];
+        if (code >= 0)
+        {
+            m_packed[i >> 5] |= (uint64_t) code << (2 * (i & 31));
+        }
+        else if (!m_runs.empty() && m_runs.back().m_start + m_runs.back().m_length == i && m_runs.back().m_base == sequence[i])
+        {
+            m_runs.back().m_length++;
+        }
+        else
+        {
+            m_runs.push_back(BaseRun{ i, 1, sequence[i] });
+        }
+    }
+    m_words = m_packed.data();
+    m_runsBegin = m_runs.data();
+    m_runsEnd = m_runsBegin + m_runs.size();
+}
+
+GenomeImpl::GenomeImpl(const std::string& nm, const std::shared_ptr<const MappedFile>& file, size_t offset, int length, int lineBases, int lineWidth)
+: m_name(nm), m_length(length), m_words(nullptr), m_runsBegin(nullptr), m_runsEnd(nullptr), m_file(file), m_offset(offset), m_lineBases(lineBases), m_lineWidth(lineWidth)
+{
+}
+
+GenomeImpl::GenomeImpl(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, const uint64_t* words, const BaseRun* runs, const BaseRun* runsEnd)
+: m_name(nm), m_length(length), m_words(words), m_runsBegin(runs), m_runsEnd(runsEnd), m_image(image), m_offset(0), m_lineBases(0), m_lineWidth(0)
+{
+}
+
+// A genome's part of an index image: its (length + 31) / 32 packed words,
+// the number of runs as a uint64_t, then the runs themselves, padded out to
+// a whole number of words so the next genome's words stay aligned.
+size_t GenomeImpl::imageSize() const
+{
+    if (m_file) // it will be packed first, so count the runs that gives
+    {
+        std::string sequence;
+        extract(0, m_length, sequence);
+        return GenomeImpl(m_name, sequence).imageSize();
+    }
+    size_t bytes = ((size_t) m_length + 31) / 32 * sizeof(uint64_t) + sizeof(uint64_t) + (m_runsEnd - m_runsBegin) * sizeof(BaseRun);
+    return (bytes + 7) & ~(size_t) 7;
+}
+
+void GenomeImpl::saveImage(std::ostream& out) const
+{
+    if (m_file) // pack it first, just as load would have
+    {
+        std::string sequence;
+        extract(0, m_length, sequence);
+        GenomeImpl(m_name, sequence).saveImage(out);
+        return;
+    }
+    uint64_t runs = m_runsEnd - m_runsBegin;
+    size_t bytes = ((size_t) m_length + 31) / 32 * sizeof(uint64_t) + sizeof(uint64_t) + runs * sizeof(BaseRun);
+    out.write(reinterpret_cast<const char*>(m_words), ((size_t) m_length + 31) / 32 * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(&runs), sizeof(runs));
+    out.write(reinterpret_cast<const char*>(m_runsBegin), runs * sizeof(BaseRun));
+    const char padding[8] = { 0 };
+    out.write(padding, ((bytes + 7) & ~(size_t) 7) - bytes);
+}
+
+// Checks a saved genome's words and runs against its length before using
+// them where they are.
+std::shared_ptr<const GenomeImpl> GenomeImpl::attachImage(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, size_t offset, size_t size)
+{
+    size_t wordBytes = ((size_t) length + 31) / 32 * sizeof(uint64_t);
+    if (length < 0 || offset % sizeof(uint64_t) != 0 || offset > image->size() || size > image->size() - offset || size < wordBytes + sizeof(uint64_t))
+    {
+        return nullptr;
+    }
+    const char* data = image->data() + offset;
+    uint64_t runs;
+    std::memcpy(&runs, data + wordBytes, sizeof(runs));
+    if (runs > (size - wordBytes - sizeof(uint64_t)) / sizeof(BaseRun))
+    {
+        return nullptr;
+    }
+    const BaseRun* first = reinterpret_cast<const BaseRun*>(data + wordBytes + sizeof(uint64_t));
+    int end = 0;
+    for (uint64_t r = 0; r < runs; r++)
+    {
+        if (first[r].m_start < end || first[r].m_length <= 0 || first[r].m_length > length - first[r].m_start)
+        {
+            return nullptr;
+        }
+        end = first[r].m_start + first[r].m_length;
+    }
+    return std::shared_ptr<const GenomeImpl>(new GenomeImpl(nm, length, image, reinterpret_cast<const uint64_t*>(data), first, first + runs));
 }
 
 bool GenomeImpl::load(std::istream& genomeSource, std::vector<Genome>& genomes)
 {
-    // .eof, .get
-    // .get gets a char
-    // .eof checks if we are at the end of a txt file
-    // getline gets the entire line until the newline char (doesn't get the newline char)
+    // The file is read a block at a time and each line's run of bases is
+    // copied over in one go, but the rules are the ones a char-by-char read
+    // applies: no more than 80 bases per line, no empty lines, no names
+    // without bases, nothing but ACGTN (either case) in a sequence.
+    BlockReader reader(genomeSource);
+    const FastaBases& fasta = fastaBases();
     std::string sequence = "";
     std::string name = "";
     int charsPerLine = 0;
-
-    //char curr = genomeSource.get();;
-    char curr;
-    while (genomeSource.get(curr))
+    sequence.reserve(reader.remaining()); // cleared, not freed, between genomes
+    
+    while (reader.more())
     {
         if (charsPerLine > 80) // takes care of the case where there are more than 80 chars per line (in the sequence portion)
         {
             return false;
         }
         
-        if (curr == '>')
+        char curr = *reader.m_next;
+        if (fasta.m_base[(unsigned char) curr] != 0)
         {
+            // take the run of bases up to where the line gets too long
+            const char* run = reader.m_next;
+            const char* limit = run + std::min<ptrdiff_t>(reader.m_end - run, 81 - charsPerLine);
+            const char* end = run;
+            while (end < limit && fasta.m_base[(unsigned char) *end] != 0)
+            {
+                end++;
+            }
+            size_t at = sequence.size();
+            sequence.resize(at + (end - run));
+            for (char* out = &sequence[at]; run < end; run++)
+            {
+                *out++ = fasta.m_base[(unsigned char) *run];
+            }
+            charsPerLine += (int) (end - reader.m_next);
+            reader.m_next = end;
+        }
+        
+        else if (curr == '>')
+        {
+            reader.m_next++;
             if (sequence.empty() && !name.empty()) // if no base lines after name
             {
                 return false;
@@ -60,23 +492,18 @@ bool GenomeImpl::load(std::istream& genomeSource, std::vector<Genome>& genomes)
             if (!sequence.empty() && !name.empty())
             {
                 genomes.push_back(Genome(name, sequence));
-                sequence = ""; // reset
+                sequence.clear(); // reset
             }
-            getline(genomeSource, name);// if it's the first one/ new name
+            name = reader.getline(); // if it's the first one/ new name
             if (name.empty()) // if name line is empty
             {
                 return false;
             }
         }
         
-        else if (curr == 'A' || curr == 'T' || curr == 'C' || curr == 'G' || curr == 'N' || curr == 'a' || curr == 't' || curr == 'c' || curr == 'g' || curr == 'n')
-        {
-            sequence += toupper(curr);
-            charsPerLine++;
-        }
-        
         else if (curr == '\n')
         {
+            reader.m_next++;
             if (charsPerLine == 0)
             {
                 return false;
@@ -88,8 +515,6 @@ bool GenomeImpl::load(std::istream& genomeSource, std::vector<Genome>& genomes)
         {
             return false;
         }
-        
-      //  curr = genomeSource.get();
     }
     
     if (sequence.empty())
@@ -101,9 +526,36 @@ bool GenomeImpl::load(std::istream& genomeSource, std::vector<Genome>& genomes)
     return true;
 }
 
+bool GenomeImpl::loadIndexed(const std::string& filename, std::vector<Genome>& genomes)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(filename))
+    {
+        return false;
+    }
+    std::vector<FastaRecord> records;
+    const std::string indexName = filename + ".fai";
+    if (!readFastaIndex(indexName, filename, *file, records))
+    {
+        records.clear();
+        if (!indexFasta(*file, records)) // not laid out evenly, so read it the ordinary way
+        {
+            std::ifstream genomeSource(filename);
+            return genomeSource && load(genomeSource, genomes);
+        }
+        writeFastaIndex(indexName, records); // it's fine if this can't be written
+    }
+    for (int i = 0; i < records.size(); i++)
+    {
+        const FastaRecord& r = records[i];
+        genomes.push_back(Genome(std::make_shared<const GenomeImpl>(r.m_name, file, r.m_offset, r.m_length, r.m_lineBases, r.m_lineWidth)));
+    }
+    return true;
+}
+
 int GenomeImpl::length() const
 {
-    return (int) m_sequence.size();
+    return m_length;
 }
 
 std::string GenomeImpl::name() const
@@ -113,17 +565,136 @@ std::string GenomeImpl::name() const
 
 bool GenomeImpl::extract(int position, int length, std::string& fragment) const
 {
-    if (length > m_sequence.size() || position < 0 || position + length > m_sequence.size())
+    if (length < 0 || length > m_length || position < 0 || position + length > m_length)
     {
         return false;
     }
+    else if (m_file)
+    {
+        fragment.resize(length);
+        return copyMapped(position, length, &fragment[0]);
+    }
     else
     {
-        fragment = m_sequence.substr(position, length);
+        const PackedBytes& bytes = packedBytes();
+        fragment.resize(length);
+        char* out = &fragment[0];
+        int end = position + length;
+        int i = position;
+        for (; i < end && (i & 3) != 0; i++) // up to a byte boundary
+        {
+            *out++ = kPackedBases[(m_words[i >> 5] >> (2 * (i & 31))) & 3];
+        }
+        for (; i + 4 <= end; i += 4) // then a byte (four bases) at a time
+        {
+            unsigned char byte = (unsigned char) (m_words[i >> 5] >> (2 * (i & 31)));
+            memcpy(out, bytes.m_bases[byte], 4);
+            out += 4;
+        }
+        for (; i < end; i++)
+        {
+            *out++ = kPackedBases[(m_words[i >> 5] >> (2 * (i & 31))) & 3];
+        }
+        for (const BaseRun* run = firstRunEndingAfter(position); run != m_runsEnd && run->m_start < end; run++)
+        {
+            int from = std::max(run->m_start, position);
+            int to = std::min(run->m_start + run->m_length, end);
+            std::fill(fragment.begin() + (from - position), fragment.begin() + (to - position), run->m_base);
+        }
         return true;
     }
 }
 
+uint64_t GenomeImpl::packedWord(int position) const
+{
+    if (position < 0 || position >= m_length)
+    {
+        return 0;
+    }
+    if (m_file)
+    {
+        char bases[32];
+        int count = std::min(32, m_length - position);
+        copyMapped(position, count, bases);
+        const BaseCodes& codes = baseCodes();
+        uint64_t word = 0;
+        for (int i = 0; i < count; i++)
+        {
+            word |= (uint64_t) std::max<int>(codes.m_code[(unsigned char) bases[i]], 0) << (2 * i);
+        }
+        return word;
+    }
+    int word = position >> 5;
+    int shift = 2 * (position & 31);
+    uint64_t bases = m_words[word] >> shift;
+    if (shift != 0 && word + 1 < (m_length + 31) / 32)
+    {
+        bases |= m_words[word + 1] << (64 - shift);
+    }
+    return bases;
+}
+
+bool GenomeImpl::containsN(int position, int length) const
+{
+    if (m_file)
+    {
+        const BaseCodes& codes = baseCodes();
+        int end = std::min(position + length, m_length);
+        char bases[256];
+        for (int i = std::max(position, 0); i < end; i += 256)
+        {
+            int count = std::min(256, end - i);
+            if (!copyMapped(i, count, bases))
+            {
+                return true; // what isn't a base can't be matched
+            }
+            for (int b = 0; b < count; b++)
+            {
+                if (codes.m_code[(unsigned char) bases[b]] < 0)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    const BaseRun* run = firstRunEndingAfter(position);
+    return length > 0 && run != m_runsEnd && run->m_start < position + length;
+}
+
+// Copies bases out of the mapped file, skipping the newlines and
+// uppercasing as load would have. Returns false, having copied each byte
+// that isn't a base as N, if there were any: load would have refused them.
+bool GenomeImpl::copyMapped(int position, int length, char* out) const
+{
+    bool bases = true;
+    const FastaBases& fasta = fastaBases();
+    const char* first = m_file->data() + m_offset;
+    int line = position / m_lineBases;
+    int column = position % m_lineBases;
+    while (length > 0)
+    {
+        int count = std::min(length, m_lineBases - column);
+        const char* in = first + (size_t) line * m_lineWidth + column;
+        for (int i = 0; i < count; i++)
+        {
+            char base = fasta.m_base[(unsigned char) in[i]];
+            out[i] = base != 0 ? base : 'N';
+            bases = bases && base != 0;
+        }
+        out += count;
+        length -= count;
+        line++;
+        column = 0;
+    }
+    return bases;
+}
+
+const GenomeImpl::BaseRun* GenomeImpl::firstRunEndingAfter(int position) const
+{
+    return std::upper_bound(m_runsBegin, m_runsEnd, position, [](int pos, const BaseRun& run) { return pos < run.m_start + run.m_length; });
+}
+
 //******************** Genome functions ************************************
 
 // These functions simply delegate to GenomeImpl's functions.
@@ -131,24 +702,34 @@ bool GenomeImpl::extract(int position, int length, std::string& fragment) const
 
 Genome::Genome(const std::string& nm, const std::string& sequence)
 {
-    m_impl = new GenomeImpl(nm, sequence);
+    m_impl = std::make_shared<const GenomeImpl>(nm, sequence);
+}
+
+Genome::Genome(std::shared_ptr<const GenomeImpl> impl) : m_impl(std::move(impl))
+{
 }
 
 Genome::~Genome()
 {
-    delete m_impl;
 }
 
-Genome::Genome(const Genome& other)
+Genome::Genome(const Genome& other) : m_impl(other.m_impl)
 {
-    m_impl = new GenomeImpl(*other.m_impl);
 }
 
 Genome& Genome::operator=(const Genome& rhs)
 {
-    GenomeImpl* newImpl = new GenomeImpl(*rhs.m_impl);
-    delete m_impl;
-    m_impl = newImpl;
+    m_impl = rhs.m_impl;
+    return *this;
+}
+
+Genome::Genome(Genome&& other) noexcept : m_impl(std::move(other.m_impl))
+{
+}
+
+Genome& Genome::operator=(Genome&& rhs) noexcept
+{
+    m_impl = std::move(rhs.m_impl);
     return *this;
 }
 
@@ -157,6 +738,32 @@ bool Genome::load(std::istream& genomeSource, std::vector<Genome>& genomes)
     return GenomeImpl::load(genomeSource, genomes);
 }
 
+bool Genome::loadIndexed(const std::string& filename, std::vector<Genome>& genomes)
+{
+    return GenomeImpl::loadIndexed(filename, genomes);
+}
+
+bool Genome::attachImage(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, size_t offset, size_t size, std::vector<Genome>& genomes)
+{
+    std::shared_ptr<const GenomeImpl> impl = GenomeImpl::attachImage(nm, length, image, offset, size);
+    if (!impl)
+    {
+        return false;
+    }
+    genomes.push_back(Genome(std::move(impl)));
+    return true;
+}
+
+size_t Genome::imageSize() const
+{
+    return m_impl->imageSize();
+}
+
+void Genome::saveImage(std::ostream& out) const
+{
+    m_impl->saveImage(out);
+}
+
 int Genome::length() const
 {
     return m_impl->length();
@@ -171,3 +778,54 @@ bool Genome::extract(int position, int length, std::string& fragment) const
 {
     return m_impl->extract(position, length, fragment);
 }
+
+uint64_t Genome::packedWord(int position) const
+{
+    return m_impl->packedWord(position);
+}
+
+bool Genome::containsN(int position, int length) const
+{
+    return m_impl->containsN(position, length);
+}
+
+bool Genome::view(int position, int length, GenomeView& fragment) const
+{
+    if (length < 0 || length > m_impl->length() || position < 0 || position + length > m_impl->length())
+    {
+        return false;
+    }
+    fragment.m_genome = m_impl.get();
+    fragment.m_position = position;
+    fragment.m_length = length;
+    return true;
+}
+
+//******************** GenomeView functions ********************************
+
+GenomeView::GenomeView() : m_genome(nullptr), m_position(0), m_length(0)
+{
+}
+
+int GenomeView::length() const
+{
+    return m_length;
+}
+
+uint64_t GenomeView::packedWord(int position) const
+{
+    if (position < 0 || position >= m_length)
+    {
+        return 0;
+    }
+    uint64_t bases = m_genome->packedWord(m_position + position);
+    int left = m_length - position;
+    return left < 32 ? bases & ((uint64_t(1) << (2 * left)) - 1) : bases;
+}
+
+bool GenomeView::containsN(int position, int length) const
+{
+    position = std::max(position, 0);
+    length = std::min(length, m_length - position);
+    return length > 0 && m_genome->containsN(m_position + position, length);
+}
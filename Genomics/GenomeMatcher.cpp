@@ -8,230 +8,2038 @@
 
 #include "provided.h"
 #include "Trie.h"
+#include "FMIndex.h"
+#include "KmerHash.h"
+#include "MappedFile.h"
+#include "Parallel.h"
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
 
 #include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <climits>
 //using namespace std;
 
+// Seed lengths above this index into a path-compressed trie; below it nearly
+// every level is branchy and plain nodes are cheaper to build.
+const int kCompressPathsAbove = 12;
+
 class GenomeMatcherImpl
 {
 public:
-    GenomeMatcherImpl(int minSearchLength);
+    GenomeMatcherImpl(int minSearchLength, SeedIndex seedIndex, int minimizerWindow, bool bothStrands);
     ~GenomeMatcherImpl();
     void addGenome(const Genome& genome);
+    void addGenomes(const std::vector<Genome>& genomes, int threads);
+    void loadFiles(const std::vector<std::string>& filenames, int threads, std::vector<LoadedFile>& results);
+    bool removeGenome(const std::string& name);
+    bool replaceGenome(const Genome& genome);
+    void compact();
     int minimumSearchLength() const;
-    bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const;
-    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results) const;
+    bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, const SearchLimits& limits, std::vector<DNAMatch>& matches) const;
+    void findGenomesWithThisDNABatch(const std::vector<std::string>& fragments, int minimumLength, bool exactMatchOnly, int threads, std::vector<std::vector<DNAMatch>>& results) const;
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results, int threads, int stride) const;
+    bool saveIndex(const std::string& filename) const;
+    bool openIndex(const std::string& filename);
 private:
     
-    struct genHolder
+    struct genHolder // plain data (the genome's name is m_genomesVec[indexVec].name()), so the trie can be saved as an image
     {
-        std::string genomeName;
         int indexVec;
-        int genomePos;
+        int genomePos : 31;
+        unsigned reverse : 1; // stored: the k-mer was indexed as its reverse complement; found: the fragment matched that strand
     };
     
+    typedef DNATrie<genHolder> SeedTrie;
+    
     int m_minSearchLength;
-    Trie<genHolder> m_trie;
+    // The k-mer index is split by the k-mers' leading two bases (one base if
+    // minSearchLength is 1) into independent tries, so shards can be built on
+    // separate threads. Each shard holds whole k-mers, so searching the shards
+    // for one first base in A, C, G, T, N order visits hits in exactly the
+    // order a single trie would.
+    std::vector<std::unique_ptr<SeedTrie>> m_shards;
+    // With SeedIndex::FMIndex or SeedIndex::KmerHash there are no shards; one
+    // index covers every genome instead. It's built when first needed, which
+    // may be in the middle of a const search, hence the lock. Genomes added
+    // after that go into m_delta, sharded tries of all their k-mers like
+    // m_shards, until compact() builds the index afresh over them all.
+    SeedIndex m_seedIndex;
+    mutable std::unique_ptr<FMIndex> m_fmIndex;
+    mutable std::unique_ptr<KmerHash<genHolder>> m_kmerHash;
+    mutable std::unique_ptr<SeedTrie> m_nKmers; // the k-mers with an N, which don't pack 2 bits a base, for KmerHash
+    mutable std::atomic<bool> m_indexBuilt;
+    mutable int m_indexedGenomes; // the genomes the built index covers; the rest are in m_delta
+    mutable std::mutex m_indexLock;
+    std::vector<std::unique_ptr<SeedTrie>> m_delta; // made when first needed
+    // Above 1, the trie only holds each genome's (w,k)-minimizers for this w,
+    // and fragments are seeded from their own minimizers (see findSampledSeeds).
+    // Searches the minimizers can't answer in full use an FM-index instead,
+    // built like SeedIndex::FMIndex's.
+    int m_minimizerWindow;
+    // A strand-aware library indexes each k-mer as whichever of it and its
+    // reverse complement comes first, so one index finds either strand.
+    bool m_bothStrands;
     std::vector<Genome> m_genomesVec;
-
+    // A removed genome is only marked here, so its hits are skipped, until
+    // compact() takes it out of the seed index and the library, numbering the
+    // genomes that are left afresh.
+    std::vector<char> m_removed;
+    std::shared_ptr<MappedFile> m_image; // an opened index image the shards may still be reading from
+    
+    static std::vector<std::unique_ptr<SeedTrie>> makeShards(int minSearchLength);
+    int shardOf(const char* kmer) const;
+    void buildIndex() const;
+    const FMIndex& fmIndex() const;
+    template<typename Visit>
+    bool findHashedSeeds(const char* key, bool exactMatchOnly, Visit visit) const;
+    // A Wanted for lookups without a budget (see findSampledSeeds).
+    struct Unbounded
+    {
+        bool operator()(long long) const { return true; }
+    };
+    template<typename Visit, typename Wanted = Unbounded>
+    bool findIndexedSeeds(const FMIndex& index, const char* key, bool exactMatchOnly, Visit visit, Wanted wanted = Wanted()) const;
+    template<typename Visit, typename Wanted = Unbounded>
+    bool findBuiltSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted = Wanted()) const;
+    template<typename Visit, typename Wanted = Unbounded>
+    bool findGlobalSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted = Wanted()) const;
+    void indexGenomes(int first, int threads);
+    void insertKmers(std::vector<std::unique_ptr<SeedTrie>>& shards, int first, int threads, int window, bool canonical);
+    template<typename Visit>
+    bool findShardSeeds(const std::vector<std::unique_ptr<SeedTrie>>& shards, const char* key, bool exactMatchOnly, Visit visit) const;
+    template<typename Visit, typename Wanted = Unbounded>
+    bool findSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted = Wanted()) const;
+    template<typename Visit, typename Wanted = Unbounded>
+    bool findStrandSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted = Wanted()) const;
+    template<typename Visit>
+    bool findSeedsBatch(const std::vector<SeedTrie::KeyRef>& keys, bool exactMatchOnly, std::vector<std::vector<SeedTrie::KeyRef>>& shardKeys, std::vector<std::vector<int>>& shardKeyIndex, Visit visit) const;
+    template<typename Wanted, typename Visit>
+    bool findSampledSeeds(const char* fragment, int length, int minimumLength, bool exactMatchOnly, Wanted wanted, Visit visit) const;
+    class MatchCollector;
+    struct MatchScratch;
+    struct PackedQuery;
+    void matchFragments(const std::vector<SeedTrie::KeyRef>& fragments, const std::vector<std::vector<DNAMatch>*>& matches, int minimumLength, bool exactMatchOnly, MatchScratch& scratch, const PackedQuery* query = nullptr) const;
 };
 
-GenomeMatcherImpl::GenomeMatcherImpl(int minSearchLength)
+static int baseCode(char base) // A, C, G, T, N in the DNA trie's child order; -1 for anything else
 {
-    m_minSearchLength = minSearchLength;
+    switch (base)
+    {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        case 'N': return 4;
+        default: return -1;
+    }
 }
 
-GenomeMatcherImpl::~GenomeMatcherImpl()
+static char complement(char base) // N, or anything else, is its own complement
 {
-    
+    switch (base)
+    {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return base;
+    }
 }
 
-void GenomeMatcherImpl::addGenome(const Genome& genome)
+static std::string reverseComplement(const char* sequence, int length)
 {
-    m_genomesVec.push_back(genome); // entire genome(not just subGenome) into private vector
-    std::string subGenome = "";
-    for (int i = 0; i + minimumSearchLength() <= genome.length(); i++) // as long as the subGenome fits in the genome and doesn't go over
+    std::string reverse(length, 'N');
+    for (int i = 0; i < length; i++)
+    {
+        reverse[length - 1 - i] = complement(sequence[i]);
+    }
+    return reverse;
+}
+
+// The canonical form of sequence's k-mer at position: whichever of it and
+// its reverse complement (found in reverse, sequence's reverse complement)
+// comes first. reversed says whether it was the reverse complement.
+static const char* canonicalKmer(const std::string& sequence, const std::string& reverse, int position, int k, bool& reversed)
+{
+    const char* forward = sequence.data() + position;
+    const char* backward = reverse.data() + reverse.size() - position - k;
+    reversed = std::memcmp(backward, forward, k) < 0;
+    return reversed ? backward : forward;
+}
+
+static uint64_t reversedBases(uint64_t word) // the 32 bases packed in word, last first
+{
+    word = __builtin_bswap64(word);
+    word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+}
+
+// Appends to positions, in increasing order and once each, where the
+// (window,k)-minimizers of sequence[0, length) start: for every run of window
+// consecutive k-mers, the one whose hashed bases (its last 32 at most) are
+// smallest, the leftmost on a tie. K-mers with anything but A, C, G or T in
+// them are never chosen.
+// A sequence too short for a full window gets the minimizer of what it has.
+static void minimizers(const char* sequence, int length, int k, int window, std::vector<int>& positions)
+{
+    int kmers = length - k + 1;
+    if (kmers <= 0)
+    {
+        return;
+    }
+    std::vector<uint64_t> order(kmers, UINT64_MAX); // UINT64_MAX for a k-mer that can't be chosen
+    uint64_t packed = 0; // the last (up to) 32 bases read, 2 bits each
+    uint64_t mask = k >= 32 ? UINT64_MAX : ((uint64_t) 1 << (2 * k)) - 1;
+    int lastInvalid = -1;
+    for (int i = 0; i < length; i++)
     {
-        bool extractSuccess = genome.extract(i, minimumSearchLength(), subGenome); // get the subGenome
-        if(extractSuccess)
+        int code = baseCode(sequence[i]);
+        if (code < 0 || code > 3)
         {
-            genHolder currHolder; // create a holder
-            currHolder.genomeName = genome.name(); // update the holder with the appropriate data
-            currHolder.genomePos = i;
-            currHolder.indexVec = (int) m_genomesVec.size() - 1;
-            m_trie.insert(subGenome, currHolder);// subGenome is the key because it's unique and currHolder is the ValueType in this case
+            lastInvalid = i;
+            code = 0;
+        }
+        packed = (packed << 2) | code;
+        int start = i - k + 1;
+        if (start >= 0 && lastInvalid < start)
+        {
+            uint64_t h = packed & mask; // a splitmix64 finish, so runs like AAAA... aren't always chosen
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            order[start] = (h ^ (h >> 31)) & (UINT64_MAX - 1);
+        }
+    }
+    int best = -1;
+    for (int last = std::min(window, kmers) - 1; last < kmers; last++) // the window ending at k-mer last
+    {
+        int first = last - std::min(window, kmers) + 1;
+        if (best < first)
+        {
+            best = first;
+            for (int i = first + 1; i <= last; i++)
+            {
+                if (order[i] < order[best])
+                {
+                    best = i;
+                }
+            }
+        }
+        else if (order[last] < order[best])
+        {
+            best = last;
+        }
+        if (order[best] != UINT64_MAX && (positions.empty() || positions.back() != best))
+        {
+            positions.push_back(best);
         }
     }
 }
 
-int GenomeMatcherImpl::minimumSearchLength() const
+GenomeMatcherImpl::GenomeMatcherImpl(int minSearchLength, SeedIndex seedIndex, int minimizerWindow, bool bothStrands)
+: m_seedIndex(seedIndex), m_indexBuilt(false), m_indexedGenomes(0), m_minimizerWindow(seedIndex == SeedIndex::KmerTrie && !bothStrands ? std::max(minimizerWindow, 1) : 1),
+  m_bothStrands(bothStrands)
 {
-    return m_minSearchLength;
+    m_minSearchLength = minSearchLength;
+    if (seedIndex == SeedIndex::KmerHash && minSearchLength > 32) // too long to pack into a word
+    {
+        m_seedIndex = SeedIndex::KmerTrie;
+    }
+    if (m_seedIndex == SeedIndex::KmerTrie)
+    {
+        m_shards = makeShards(minSearchLength);
+    }
 }
 
-bool GenomeMatcherImpl::findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const
+std::vector<std::unique_ptr<GenomeMatcherImpl::SeedTrie>> GenomeMatcherImpl::makeShards(int minSearchLength)
 {
-    if (fragment.size() < minimumLength || minimumLength < minimumSearchLength())
+    std::vector<std::unique_ptr<SeedTrie>> shards;
+    int count = minSearchLength >= 2 ? 25 : 5;
+    for (int i = 0; i < count; i++)
     {
-        return false;
+        shards.push_back(std::unique_ptr<SeedTrie>(new SeedTrie(minSearchLength > kCompressPathsAbove))); // long k-mers are mostly unique past their first dozen bases, so their chains are compressed
+    }
+    return shards;
+}
+
+int GenomeMatcherImpl::shardOf(const char* kmer) const
+{
+    int first = baseCode(kmer[0]);
+    if (m_minSearchLength < 2 || first < 0)
+    {
+        return first;
+    }
+    int second = baseCode(kmer[1]);
+    return second < 0 ? -1 : first * 5 + second;
+}
+
+void GenomeMatcherImpl::buildIndex() const // builds the FM-index or k-mer hash over every genome if there isn't one
+{
+    if (m_indexBuilt)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_indexLock);
+    if (m_indexBuilt)
+    {
+        return;
+    }
+    m_indexedGenomes = (int) m_genomesVec.size();
+    if (m_seedIndex == SeedIndex::FMIndex || m_minimizerWindow > 1)
+    {
+        std::vector<std::string> sequences(m_genomesVec.size()); // a removed genome's stays empty, so the ids still line up
+        for (int g = 0; g < sequences.size(); g++)
+        {
+            if (!m_removed[g])
+            {
+                m_genomesVec[g].extract(0, m_genomesVec[g].length(), sequences[g]);
+            }
+        }
+        std::unique_ptr<FMIndex> index(new FMIndex);
+        index->build(sequences);
+        m_fmIndex.swap(index);
+        m_indexBuilt = true;
+        return;
     }
     
-    bool matchFound = false;
-    
-    const std::vector<genHolder> find = m_trie.find(fragment.substr(0, minimumSearchLength()), exactMatchOnly); // getting all subfrags (or SNiPs) of fragment that are at least the minimum length and putting it in a vector
-    if (!find.empty()) // if there's something of at least the minimum search length
+    // every k-mer is packed with a rolling encoder, first base highest, once
+    // to count it and once to place it, in genome then position order so
+    // hits come back as the trie would give them (a strand-aware library
+    // rolls the reverse complement along too, and keeps the smaller)
+    const int k = minimumSearchLength();
+    const uint64_t mask = k >= 32 ? UINT64_MAX : ((uint64_t) 1 << (2 * k)) - 1;
+    std::unique_ptr<KmerHash<genHolder>> hash(new KmerHash<genHolder>);
+    std::unique_ptr<SeedTrie> nKmers(new SeedTrie(k > kCompressPathsAbove));
+    for (int pass = 0; pass < 2; pass++)
     {
-        for (int i = (int) fragment.size(); i >= minimumLength; i--) // for (int i = minimumLength; i <= fragment.size(); i++)
+        for (int g = 0; g < m_genomesVec.size(); g++)
         {
-            for (int j = 0; j < find.size(); j++) // for each subfrag we found
+            if (m_removed[g])
+            {
+                continue;
+            }
+            std::string sequence;
+            m_genomesVec[g].extract(0, m_genomesVec[g].length(), sequence);
+            std::string reverse = m_bothStrands ? reverseComplement(sequence.data(), (int) sequence.size()) : std::string();
+            uint64_t kmer = 0;
+            uint64_t reverseKmer = 0;
+            int lastN = -1;
+            int lastOther = -1; // the trie can't hold anything but A, C, G, T and N
+            for (int i = 0; i < (int) sequence.size(); i++)
             {
-                const Genome& g = m_genomesVec[find[j].indexVec]; // we're finding the genome that corresponds to the curr sub
-                std::string candidate = "";
-                g.extract(find[j].genomePos, i, candidate); // candidate is now the potential match
-                
-                int length = 0;
-                bool addMatch = true;
-                bool oneMismatch;
-                
-                if (exactMatchOnly)
+                int code = baseCode(sequence[i]);
+                if (code < 0)
                 {
-                    oneMismatch = true; // we've already "found a mismatch" and won't allow for finding another one
+                    lastOther = i;
                 }
-                else
+                else if (code == 4)
                 {
-                    oneMismatch = false;
+                    lastN = i;
                 }
-                
-                for (int k = 0; k < candidate.size(); k++)
+                kmer = ((kmer << 2) | (code & 3)) & mask;
+                reverseKmer = (reverseKmer >> 2) | ((uint64_t) (3 - (code & 3)) << (2 * (k - 1)));
+                int start = i - k + 1;
+                if (start < 0 || lastOther >= start)
                 {
-                    if (candidate[k] == fragment[k])
-                    {
-                        length++;
-                    }
-                    else if (candidate[k] != fragment[k] && !oneMismatch)
-                    {
-                        oneMismatch = true;
-                        length++;
-                    }
-                    else
-                    {
-                        addMatch = false;
-                        break;
-                    }
+                    continue;
                 }
-                
-                for (int m = 0; m < matches.size(); m++)
+                genHolder holder;
+                holder.indexVec = g;
+                holder.genomePos = start;
+                holder.reverse = 0;
+                if (lastN >= start)
                 {
-                    if (matches[m].genomeName == find[j].genomeName)
+                    if (pass == 0)
                     {
-                        addMatch = false;
+                        bool reversed = false;
+                        const char* key = m_bothStrands ? canonicalKmer(sequence, reverse, start, k, reversed) : sequence.data() + start;
+                        holder.reverse = reversed;
+                        nKmers->insert(key, k, holder);
                     }
+                    continue;
                 }
-
-                if (addMatch && length >= minimumLength)
+                uint64_t key = kmer;
+                if (m_bothStrands && reverseKmer < kmer)
+                {
+                    key = reverseKmer;
+                    holder.reverse = 1;
+                }
+                if (pass == 0)
+                {
+                    hash->count(key);
+                }
+                else
                 {
-                    matchFound = true;
-                    DNAMatch match;
-                    match.length = length;
-                    match.genomeName = find[j].genomeName;
-                    match.position = find[j].genomePos;
-                    matches.push_back(match);
+                    hash->place(key, holder);
                 }
             }
         }
+        if (pass == 0)
+        {
+            hash->layout();
+        }
     }
-    
-    if (!matchFound)
-        return false;
-    return true;
+    m_kmerHash.swap(hash);
+    m_nKmers.swap(nKmers);
+    m_indexBuilt = true;
 }
 
-bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results) const
+const FMIndex& GenomeMatcherImpl::fmIndex() const
 {
-    if (fragmentMatchLength < minimumSearchLength())
+    buildIndex();
+    return *m_fmIndex;
+}
+
+// findSeeds for SeedIndex::KmerHash: each variant of the key (itself, then
+// with one base after the first swapped for another) is looked up on its
+// own, in the order a trie walk would reach them, A, C, G, T, N at each base.
+template<typename Visit>
+bool GenomeMatcherImpl::findHashedSeeds(const char* key, bool exactMatchOnly, Visit visit) const
+{
+    buildIndex();
+    const int k = minimumSearchLength();
+    uint64_t packed = 0;
+    int others = 0; // bases no k-mer has
+    int ns = 0;
+    std::vector<int> codes(k);
+    for (int i = 0; i < k; i++)
     {
-        return false;
+        codes[i] = baseCode(key[i]);
+        others += codes[i] < 0;
+        ns += codes[i] == 4;
+        packed = (packed << 2) | (codes[i] & 3);
+    }
+    if (codes[0] < 0)
+    {
+        return true;
     }
     
-    int loopCount = 1;
-    bool matchFound = false;
-    std::unordered_map<std::string, int> tempMap; // int to store the genome length
-    for (int i = 0; i < query.length(); i = loopCount * fragmentMatchLength)
+    std::vector<std::pair<int, int>> variants(1, std::make_pair(k, 0)); // position swapped (k for none) and the new base's code
+    for (int i = 1; !exactMatchOnly && i < k; i++)
     {
-        std::vector<DNAMatch> seqMatches;
-        std::string sequence = "";
-        query.extract(i, fragmentMatchLength, sequence);
-        if (findGenomesWithThisDNA(sequence, (int) sequence.size(), exactMatchOnly, seqMatches))
+        for (int code = 0; code < 5; code++)
         {
-            for (int j = 0; j < seqMatches.size(); j++)
+            if (code != codes[i])
             {
-               if (tempMap.find(seqMatches[j].genomeName) == tempMap.end()) // if this name doesnt exist in the temp map yet
-               {
-                    tempMap.insert(std::unordered_map<std::string, int>::value_type(seqMatches[j].genomeName, 1)); // insert into the map
-                }
-               else // does exist
-               {
-                   tempMap.find(seqMatches[j].genomeName)++;
-               }
+                variants.push_back(std::make_pair(i, code));
+            }
+        }
+    }
+    std::sort(variants.begin(), variants.end(), [&codes](const std::pair<int, int>& x, const std::pair<int, int>& y)
+    {
+        if (x.first == y.first)
+        {
+            return x.second < y.second;
+        }
+        int first = std::min(x.first, y.first); // where they differ first; the other has the key's base there
+        return (x.first == first ? x.second : codes[first]) < (y.first == first ? y.second : codes[first]);
+    });
+    for (int v = 0; v < variants.size(); v++)
+    {
+        int position = variants[v].first;
+        int code = variants[v].second;
+        int replaced = position < k ? codes[position] : 0;
+        if (others - (replaced < 0) > 0)
+        {
+            continue;
+        }
+        if (position < k ? code == 4 || ns - (replaced == 4) > 0 : ns > 0)
+        {
+            std::string variant(key, k);
+            if (position < k)
+            {
+                variant[position] = "ACGTN"[code];
             }
-            
-            for (std::unordered_map<std::string, int>::const_iterator p = tempMap.begin(); p != tempMap.end(); p++)
+            if (!m_nKmers->find(variant.data(), k, true, visit))
             {
-                double percent = ((p->second) / (query.length()/fragmentMatchLength)) * 100;
-                if (percent >= matchPercentThreshold) // add to our vector
-                {
-                    matchFound = true;
-                    GenomeMatch match;
-                    match.genomeName = p->first;
-                    match.percentMatch = percent;
-                    results.push_back(match);
-                    
-                }
+                return false;
             }
+            continue;
+        }
+        uint64_t kmer = packed;
+        if (position < k)
+        {
+            int shift = 2 * (k - 1 - position);
+            kmer = (kmer & ~((uint64_t) 3 << shift)) | ((uint64_t) code << shift);
+        }
+        if (!m_kmerHash->find(kmer, visit))
+        {
+            return false;
         }
-        loopCount++;
     }
-    
-    if (!matchFound)
-        return false;
     return true;
 }
 
-//******************** GenomeMatcher functions ********************************
+template<typename Visit, typename Wanted>
+bool GenomeMatcherImpl::findIndexedSeeds(const FMIndex& index, const char* key, bool exactMatchOnly, Visit visit, Wanted wanted) const
+{
+    return index.find(key, minimumSearchLength(), exactMatchOnly, [&visit](int genome, int position)
+    {
+        genHolder hit;
+        hit.indexVec = genome;
+        hit.genomePos = position;
+        hit.reverse = 0;
+        return visit(hit);
+    }, wanted);
+}
 
-// These functions simply delegate to GenomeMatcherImpl's functions.
-// You probably don't want to change any of this code.
+template<typename Visit, typename Wanted>
+bool GenomeMatcherImpl::findBuiltSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted) const // from the FM-index or k-mer hash alone
+{
+    if (m_seedIndex == SeedIndex::KmerHash) // hits stream straight out of the hash, so visit is budget enough
+    {
+        return findHashedSeeds(key, exactMatchOnly, visit);
+    }
+    return findIndexedSeeds(fmIndex(), key, exactMatchOnly, visit, wanted);
+}
 
-GenomeMatcher::GenomeMatcher(int minSearchLength)
+// findSeeds over the FM-index or k-mer hash (what a minimizer trie can't
+// answer included) and the delta tries of the genomes added since it was
+// built. Each gives its hits in trie order, and the delta's genomes all come
+// after the others, so for an exact key the delta's hits simply follow. With
+// a mismatch allowed the two are merged by the k-mer each hit is stored
+// under, as one trie of every k-mer would have them; once wanted says the
+// budget's spent, only the hits collected so far are merged and visited.
+template<typename Visit, typename Wanted>
+bool GenomeMatcherImpl::findGlobalSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted) const
 {
-    m_impl = new GenomeMatcherImpl(minSearchLength);
+    buildIndex();
+    if (m_indexedGenomes == m_genomesVec.size())
+    {
+        return findBuiltSeeds(key, exactMatchOnly, visit, wanted);
+    }
+    if (exactMatchOnly)
+    {
+        return findBuiltSeeds(key, true, visit, wanted) && findShardSeeds(m_delta, key, true, visit);
+    }
+    const int k = minimumSearchLength();
+    std::vector<genHolder> hits;
+    std::vector<char> codes; // each hit's k-mer as base codes, k apiece
+    std::string kmer;
+    auto collect = [&](const genHolder& hit)
+    {
+        m_genomesVec[hit.indexVec].extract(hit.genomePos, k, kmer);
+        for (int i = 0; i < k; i++)
+        {
+            codes.push_back((char) baseCode(hit.reverse ? complement(kmer[k - 1 - i]) : kmer[i]));
+        }
+        hits.push_back(hit);
+        return wanted((long long) hits.size());
+    };
+    if (findBuiltSeeds(key, false, collect, [&](long long located) { return wanted((long long) hits.size() + located); }))
+    {
+        findShardSeeds(m_delta, key, false, collect);
+    }
+    std::vector<int> order(hits.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int x, int y)
+    {
+        return std::memcmp(&codes[(size_t) x * k], &codes[(size_t) y * k], k) < 0;
+    });
+    for (int i = 0; i < order.size(); i++)
+    {
+        if (!visit(hits[order[i]]))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-GenomeMatcher::~GenomeMatcher()
+template<typename Visit>
+bool GenomeMatcherImpl::findShardSeeds(const std::vector<std::unique_ptr<SeedTrie>>& shards, const char* key, bool exactMatchOnly, Visit visit) const
 {
-    delete m_impl;
+    int first = baseCode(key[0]); // the first base always has to match exactly
+    if (first < 0)
+    {
+        return true;
+    }
+    if (shards.size() == 5)
+    {
+        return shards[first]->find(key, minimumSearchLength(), exactMatchOnly, visit);
+    }
+    for (int second = 0; second < 5; second++)
+    {
+        if (exactMatchOnly && second != baseCode(key[1]))
+        {
+            continue;
+        }
+        if (!shards[first * 5 + second]->find(key, minimumSearchLength(), exactMatchOnly, visit))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-void GenomeMatcher::addGenome(const Genome& genome)
+template<typename Visit, typename Wanted>
+bool GenomeMatcherImpl::findSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted) const
 {
-    m_impl->addGenome(genome);
+    if (m_seedIndex != SeedIndex::KmerTrie)
+    {
+        return findGlobalSeeds(key, exactMatchOnly, visit, wanted);
+    }
+    return findShardSeeds(m_shards, key, exactMatchOnly, visit);
 }
 
-int GenomeMatcher::minimumSearchLength() const
+// findSeeds for a strand-aware library: a hit's reverse says whether it's
+// the reverse complement of the key that's in the genome there, in which
+// case the fragment lines up with the genome read backwards from the
+// k-mer's last base. An exact key is one lookup, of its canonical form.
+// With a mismatch allowed the key and its reverse complement are both looked
+// up, and so is the reverse complement with each other first base, which
+// findSeeds never changes. The FM-index has no canonical k-mers, so both
+// strands are always looked up there.
+template<typename Visit, typename Wanted>
+bool GenomeMatcherImpl::findStrandSeeds(const char* key, bool exactMatchOnly, Visit visit, Wanted wanted) const
 {
-    return m_impl->minimumSearchLength();
+    const int k = minimumSearchLength();
+    std::string forward(key, k);
+    std::string reverse = reverseComplement(key, k);
+    auto lookup = [&](const std::string& seed, bool complemented, bool exact)
+    {
+        return findSeeds(seed.c_str(), exact, [&](const genHolder& stored)
+        {
+            genHolder hit = stored;
+            hit.reverse = (stored.reverse != 0) != complemented;
+            return visit(hit);
+        }, wanted);
+    };
+    if (exactMatchOnly && m_seedIndex != SeedIndex::FMIndex)
+    {
+        bool complemented = reverse < forward;
+        return lookup(complemented ? reverse : forward, complemented, true);
+    }
+    if (!lookup(forward, false, exactMatchOnly) || !lookup(reverse, true, exactMatchOnly))
+    {
+        return false;
+    }
+    for (int code = 0; !exactMatchOnly && code < 5; code++)
+    {
+        std::string variant = reverse;
+        variant[0] = "ACGTN"[code];
+        if (variant != reverse && !lookup(variant, true, true))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-bool GenomeMatcher::findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const
+GenomeMatcherImpl::~GenomeMatcherImpl()
+{
+    
+}
+
+template<typename Visit>
+bool GenomeMatcherImpl::findSeedsBatch(const std::vector<SeedTrie::KeyRef>& keys, bool exactMatchOnly, std::vector<std::vector<SeedTrie::KeyRef>>& shardKeys, std::vector<std::vector<int>>& shardKeyIndex, Visit visit) const
+{
+    if (m_seedIndex != SeedIndex::KmerTrie) // there's nothing to share between keys
+    {
+        for (int i = 0; i < keys.size(); i++)
+        {
+            if (!findSeeds(keys[i].m_data, exactMatchOnly, [&](const genHolder& hit) { return visit(i, hit); }))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    // hand each shard the keys that can have hits in it, visiting shards in
+    // order so every key still sees its hits in findSeeds order (shardKeys
+    // and shardKeyIndex are the caller's, so they keep their room between batches)
+    shardKeys.resize(m_shards.size());
+    shardKeyIndex.resize(m_shards.size());
+    for (int s = 0; s < m_shards.size(); s++)
+    {
+        shardKeys[s].clear();
+        shardKeyIndex[s].clear();
+    }
+    for (int i = 0; i < keys.size(); i++)
+    {
+        int first = baseCode(keys[i].m_data[0]);
+        if (first < 0)
+        {
+            continue;
+        }
+        for (int s = 0; s < m_shards.size(); s++)
+        {
+            bool searched = m_shards.size() == 5 ? s == first : (s / 5 == first && (!exactMatchOnly || s % 5 == baseCode(keys[i].m_data[1])));
+            if (searched)
+            {
+                shardKeys[s].push_back(keys[i]);
+                shardKeyIndex[s].push_back(i);
+            }
+        }
+    }
+    for (int s = 0; s < m_shards.size(); s++)
+    {
+        const std::vector<int>& index = shardKeyIndex[s];
+        if (!m_shards[s]->findBatch(shardKeys[s], exactMatchOnly, [&](int key, const genHolder& hit) { return visit(index[key], hit); }))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Seeding when only minimizers were indexed. A hit on one of the fragment's
+// minimizers says where in that genome the fragment would have to start, and
+// each such start is visited once, as a hit for the fragment's first
+// minimumSearchLength bases. An exact match covering the fragment's first
+// window of k-mers must include that window's minimizer, so when every match
+// must span a window (exact, and minimumLength at least
+// minimumSearchLength + m_minimizerWindow - 1) none is missed. Starts that
+// findSeeds wouldn't have given (a different first base) can't make a match,
+// and the rest come in findSeeds order, so the matches are exactly the
+// unsampled index's. Any other search could miss matches that way (one with
+// its every minimizer hit by a mismatch, or too short to hold a window), so
+// it's seeded from the FM-index over the whole genomes instead. So is a
+// fragment whose first window has an N in every k-mer: it has no minimizer,
+// and neither has any stretch of genome it could match.
+// wanted(n) says whether the caller still wants hits with n starts already
+// gathered; once it says no the starts found so far are the ones visited, so
+// a search with a budget stops looking as soon as it's spent. Returns false
+// if visit did.
+template<typename Wanted, typename Visit>
+bool GenomeMatcherImpl::findSampledSeeds(const char* fragment, int length, int minimumLength, bool exactMatchOnly, Wanted wanted, Visit visit) const
+{
+    const int k = minimumSearchLength();
+    std::vector<int> offsets;
+    if (exactMatchOnly && minimumLength >= k + m_minimizerWindow - 1)
+    {
+        minimizers(fragment, std::min(length, m_minimizerWindow + k - 1), k, m_minimizerWindow, offsets);
+    }
+    if (offsets.empty())
+    {
+        return findGlobalSeeds(fragment, exactMatchOnly, visit, wanted);
+    }
+    
+    // the trie would give these in order of the genome's k-mer there, A, C,
+    // G, T, N at each base, then in the order they were added; each start's
+    // k-mer goes in codes, as base codes, so they can be sorted that way
+    std::vector<genHolder> starts;
+    std::vector<char> codes;
+    std::unordered_set<uint64_t> seen; // found through more than one minimizer
+    std::string seed;
+    for (int i = 0; i < offsets.size() && wanted((long long) starts.size()); i++)
+    {
+        int offset = offsets[i];
+        findSeeds(fragment + offset, true, [&](const genHolder& hit)
+        {
+            if (hit.genomePos < offset || !seen.insert((uint64_t) hit.indexVec << 32 | (uint32_t) (hit.genomePos - offset)).second)
+            {
+                return true;
+            }
+            genHolder start;
+            start.indexVec = hit.indexVec;
+            start.genomePos = hit.genomePos - offset;
+            start.reverse = 0;
+            if (!m_genomesVec[start.indexVec].extract(start.genomePos, k, seed) || seed[0] != fragment[0])
+            {
+                return true;
+            }
+            for (int j = 0; j < k; j++)
+            {
+                seed[j] = (char) baseCode(seed[j]);
+            }
+            if (std::find(seed.begin(), seed.end(), (char) -1) != seed.end()) // the trie has no room for any other base
+            {
+                return true;
+            }
+            starts.push_back(start);
+            codes.insert(codes.end(), seed.begin(), seed.end());
+            return wanted((long long) starts.size());
+        });
+    }
+    
+    std::vector<int> order(starts.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int x, int y)
+    {
+        int compared = std::memcmp(&codes[(size_t) x * k], &codes[(size_t) y * k], k);
+        if (compared != 0)
+        {
+            return compared < 0;
+        }
+        return starts[x].indexVec != starts[y].indexVec ? starts[x].indexVec < starts[y].indexVec : starts[x].genomePos < starts[y].genomePos;
+    });
+    for (int i = 0; i < order.size(); i++)
+    {
+        if (!visit(starts[order[i]]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GenomeMatcherImpl::addGenome(const Genome& genome)
+{
+    m_genomesVec.push_back(genome); // entire genome(not just subGenome) into private vector
+    m_removed.push_back(false);
+    indexGenomes((int) m_genomesVec.size() - 1, 1);
+}
+
+void GenomeMatcherImpl::addGenomes(const std::vector<Genome>& genomes, int threads)
+{
+    int first = (int) m_genomesVec.size();
+    m_genomesVec.insert(m_genomesVec.end(), genomes.begin(), genomes.end());
+    m_removed.resize(m_genomesVec.size(), false);
+    indexGenomes(first, threads);
+}
+
+void GenomeMatcherImpl::loadFiles(const std::vector<std::string>& filenames, int threads, std::vector<LoadedFile>& results)
+{
+    const int count = (int) filenames.size();
+    std::vector<std::vector<Genome>> parsed(count);
+    results.assign(count, LoadedFile());
+    auto parse = [&](int f, int)
+    {
+        LoadedFile& result = results[f];
+        result.filename = filenames[f];
+        std::ifstream genomeSource(filenames[f]);
+        result.opened = (bool) genomeSource;
+        result.loaded = result.opened && Genome::load(genomeSource, parsed[f]);
+        if (!result.loaded)
+        {
+            parsed[f].clear(); // a bad file adds nothing, even what parsed before the problem
+        }
+        result.genomeCount = (int) parsed[f].size();
+    };
+    if (threads <= 1)
+    {
+        for (int f = 0; f < count; f++)
+        {
+            parse(f, 0);
+            addGenomes(parsed[f], 1);
+            parsed[f].clear();
+        }
+        return;
+    }
+    
+    // parse on a pool of threads while this one indexes each file, in order,
+    // as soon as it's ready; the two share the threads between them
+    const int parseThreads = (threads + 1) / 2;
+    const int indexThreads = threads - parseThreads;
+    std::mutex lock;
+    std::condition_variable parsedOne;
+    std::vector<char> ready(count, false);
+    std::exception_ptr failure; // the first thing a parser threw
+    std::atomic<bool> stop(false); // set once there's no point parsing any more
+    std::thread parsers([&]()
+    {
+        parallelFor(count, parseThreads, [&](int f, int worker)
+        {
+            std::exception_ptr error;
+            if (!stop)
+            {
+                try
+                {
+                    parse(f, worker);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                    stop = true;
+                }
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (error && !failure)
+            {
+                failure = error;
+            }
+            ready[f] = true;
+            parsedOne.notify_all();
+        });
+    });
+    try
+    {
+        for (int f = 0; f < count; f++)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                parsedOne.wait(guard, [&]() { return ready[f] != 0; });
+                if (failure)
+                {
+                    break;
+                }
+            }
+            addGenomes(parsed[f], indexThreads);
+            parsed[f].clear();
+        }
+    }
+    catch (...)
+    {
+        stop = true; // the parsers skip what they haven't started
+        parsers.join();
+        throw;
+    }
+    parsers.join();
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+void GenomeMatcherImpl::indexGenomes(int first, int threads) // index m_genomesVec[first] onwards
+{
+    if (m_seedIndex == SeedIndex::KmerTrie)
+    {
+        insertKmers(m_shards, first, threads, m_minimizerWindow, m_bothStrands);
+    }
+    if (m_indexBuilt) // the FM-index or k-mer hash stays as it is; the new genomes go beside it
+    {
+        if (m_delta.empty())
+        {
+            m_delta = makeShards(m_minSearchLength);
+        }
+        insertKmers(m_delta, first, threads, 1, m_bothStrands && m_seedIndex != SeedIndex::FMIndex);
+    }
+}
+
+// Inserts the k-mers of m_genomesVec[first] onwards into shards: all of them,
+// or with a window above 1 only their minimizers, and if canonical each as
+// whichever of it and its reverse complement comes first.
+void GenomeMatcherImpl::insertKmers(std::vector<std::unique_ptr<SeedTrie>>& shards, int first, int threads, int window, bool canonical)
+{
+    const int k = minimumSearchLength();
+    std::vector<std::string> sequences(m_genomesVec.size() - first);
+    std::vector<std::string> reverses(canonical ? sequences.size() : 0); // their reverse complements, for canonical k-mers
+    std::vector<std::vector<int>> sampled(window > 1 ? sequences.size() : 0); // the positions to index, if not all of them
+    for (int g = 0; g < sequences.size(); g++)
+    {
+        const Genome& genome = m_genomesVec[first + g];
+        genome.extract(0, genome.length(), sequences[g]);
+        if (canonical)
+        {
+            reverses[g] = reverseComplement(sequences[g].data(), (int) sequences[g].size());
+        }
+        if (window > 1)
+        {
+            minimizers(sequences[g].data(), (int) sequences[g].size(), k, window, sampled[g]);
+        }
+    }
+    
+    // every k-mer goes into its shard in genome then position order, so each
+    // shard ends up exactly as serial insertion would leave it. Run serially
+    // that's one pass; otherwise one pass deals the k-mers out to their
+    // shards, and then each shard inserts its own.
+    std::vector<std::vector<genHolder>> buckets(threads > 1 ? shards.size() : 0);
+    auto keyOf = [&](const genHolder& holder)
+    {
+        int g = holder.indexVec - first;
+        return holder.reverse ? reverses[g].data() + reverses[g].size() - holder.genomePos - k : sequences[g].data() + holder.genomePos;
+    };
+    for (int g = 0; g < sequences.size(); g++)
+    {
+        const std::string& sequence = sequences[g];
+        int count = window > 1 ? (int) sampled[g].size() : (int) sequence.size() - k + 1;
+        for (int n = 0; n < count; n++) // as long as the subGenome fits in the genome and doesn't go over
+        {
+            int i = window > 1 ? sampled[g][n] : n;
+            bool reversed = false;
+            const char* key = canonical ? canonicalKmer(sequence, reverses[g], i, k, reversed) : sequence.data() + i;
+            int s = shardOf(key);
+            if (s < 0)
+            {
+                continue;
+            }
+            genHolder currHolder; // create a holder
+            currHolder.genomePos = i; // update the holder with the appropriate data
+            currHolder.indexVec = first + g;
+            currHolder.reverse = reversed;
+            if (threads > 1)
+            {
+                buckets[s].push_back(currHolder);
+            }
+            else
+            {
+                shards[s]->insert(key, k, currHolder); // the subGenome is the key and currHolder is the ValueType in this case
+            }
+        }
+    }
+    if (threads > 1)
+    {
+        parallelFor((int) shards.size(), threads, [&](int shard, int)
+        {
+            for (const genHolder& holder : buckets[shard])
+            {
+                shards[shard]->insert(keyOf(holder), k, holder);
+            }
+            std::vector<genHolder>().swap(buckets[shard]);
+        });
+    }
+}
+
+bool GenomeMatcherImpl::removeGenome(const std::string& name) // every genome with that name goes
+{
+    bool found = false;
+    for (int g = 0; g < m_genomesVec.size(); g++)
+    {
+        if (!m_removed[g] && m_genomesVec[g].name() == name)
+        {
+            m_removed[g] = true;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool GenomeMatcherImpl::replaceGenome(const Genome& genome)
+{
+    bool replaced = removeGenome(genome.name());
+    addGenome(genome);
+    return replaced;
+}
+
+void GenomeMatcherImpl::compact()
+{
+    // the genomes left are numbered afresh, in the same order
+    std::vector<int> renumbered(m_genomesVec.size(), -1);
+    int live = 0;
+    for (int g = 0; g < m_genomesVec.size(); g++)
+    {
+        if (!m_removed[g])
+        {
+            renumbered[g] = live;
+            m_genomesVec[live++] = m_genomesVec[g];
+        }
+    }
+    bool removed = live < m_genomesVec.size();
+    m_genomesVec.erase(m_genomesVec.begin() + live, m_genomesVec.end());
+    m_removed.assign(live, false);
+    
+    // each shard is rebuilt from the hits it keeps, so it gives back the
+    // nodes and labels only removed genomes used
+    if (removed)
+    {
+        for (int s = 0; s < m_shards.size(); s++)
+        {
+            m_shards[s]->compact([&renumbered](genHolder& hit)
+            {
+                hit.indexVec = renumbered[hit.indexVec];
+                return hit.indexVec >= 0;
+            });
+        }
+    }
+    
+    // and the FM-index or k-mer hash takes in its delta tries by being built
+    // afresh; a minimizer trie's FM-index is only built again if it's needed
+    if (removed || !m_delta.empty())
+    {
+        m_indexBuilt = false;
+        m_indexedGenomes = 0;
+        m_fmIndex.reset();
+        m_kmerHash.reset();
+        m_nKmers.reset();
+        m_delta.clear();
+        if (m_seedIndex != SeedIndex::KmerTrie)
+        {
+            buildIndex();
+        }
+    }
+}
+
+int GenomeMatcherImpl::minimumSearchLength() const
+{
+    return m_minSearchLength;
+}
+
+// Turns the seed hits for one fragment into DNAMatches: each hit is scored
+// for the longest candidate starting there that matches the fragment, in one
+// pass a word at a time, and the best hit per genome is kept. A genome whose
+// match already runs the fragment's full length can't do better, so its
+// later hits are skipped without being scored. In a
+// strand-aware library a reverse hit's candidate runs backwards from the
+// seed's last base, and a seed that's its own reverse complement is tried on
+// both strands.
+class GenomeMatcherImpl::MatchCollector
+{
+public:
+    // A collector's working storage, kept apart so a thread matching many
+    // fragments can hand the same buffers to one collector after another;
+    // a collector clears them when it's made.
+    struct Buffers
+    {
+        std::vector<uint64_t> m_fragmentWords;
+        std::vector<char> m_wordHasN;
+        std::vector<int> m_hitOrder;
+        std::unordered_map<int, int> m_genomeMatch;
+        std::unordered_map<std::string, int> m_nameMatch;
+        std::vector<int> m_order;
+        std::vector<DNAMatch> m_sorted;
+    };
+    // packed, if given, holds the fragment's bases already packed (it was cut
+    // from a Genome), so they're copied out a word at a time
+    MatchCollector(const GenomeMatcherImpl& matcher, const char* fragment, int fragmentLength, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches, Buffers& buffers, const GenomeView* packed = nullptr);
+    void limit(const SearchLimits& limits);
+    bool add(const genHolder& hit); // returns false once no more hits are wanted
+    bool wants(long long gathered) const; // whether hits past the first gathered would still be looked at
+    bool finish(); // puts the matches in order; returns whether any were found
+private:
+    void addCandidate(int genome, int position, bool reverse);
+    int matchingPrefix(const Genome& g, int position, int available, bool firstBaseExact) const;
+    int matchingReversePrefix(const Genome& g, int end, int available) const;
+    bool palindromicSeed(const Genome& g, int position) const;
+    
+    const GenomeMatcherImpl& m_matcher;
+    const char* m_fragment;
+    int m_fragmentLength;
+    Buffers& m_buffers;
+    std::vector<uint64_t>& m_fragmentWords; // the fragment packed like Genome::packedWord
+    std::vector<char>& m_wordHasN; // those words have to be compared a char at a time
+    int m_minimumLength;
+    bool m_exactMatchOnly;
+    std::vector<DNAMatch>& m_matches;
+    int m_alreadyInMatches; // genomes the caller already has matches for are left alone
+    std::vector<int>& m_hitOrder; // for each match we add, which trie hit it came from
+    std::unordered_map<int, int>& m_genomeMatch; // genome id to the m_matches entry its hits go to
+    std::unordered_map<std::string, int>& m_nameMatch; // genome name to the first m_matches entry with it
+    int m_hitIndex;
+    bool m_matchFound;
+    int m_fullMatches; // new matches as long as the fragment
+    // see SearchLimits; with none, every hit is looked at
+    int m_maxMatches;
+    int m_liveGenomes; // once they all have full-length matches there's nothing left to find
+    long long m_hitsLeft; // negative for no limit
+    bool m_timed;
+    std::chrono::steady_clock::time_point m_deadline;
+    bool m_stopped;
+};
+
+GenomeMatcherImpl::MatchCollector::MatchCollector(const GenomeMatcherImpl& matcher, const char* fragment, int fragmentLength, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches, Buffers& buffers, const GenomeView* packed)
+: m_matcher(matcher), m_fragment(fragment), m_fragmentLength(fragmentLength), m_buffers(buffers), m_fragmentWords(buffers.m_fragmentWords), m_wordHasN(buffers.m_wordHasN),
+  m_minimumLength(minimumLength), m_exactMatchOnly(exactMatchOnly), m_matches(matches),
+  m_alreadyInMatches((int) matches.size()), m_hitOrder(buffers.m_hitOrder), m_genomeMatch(buffers.m_genomeMatch), m_nameMatch(buffers.m_nameMatch),
+  m_hitIndex(0), m_matchFound(false), m_fullMatches(0), m_maxMatches(0), m_liveGenomes(INT_MAX), m_hitsLeft(-1), m_timed(false), m_stopped(false)
+{
+    m_fragmentWords.assign((fragmentLength + 31) / 32, 0);
+    m_wordHasN.assign(m_fragmentWords.size(), false);
+    m_hitOrder.clear();
+    m_genomeMatch.clear();
+    m_nameMatch.clear();
+    for (int w = 0; packed != nullptr && w < m_fragmentWords.size(); w++)
+    {
+        m_fragmentWords[w] = packed->packedWord(32 * w);
+        m_wordHasN[w] = packed->containsN(32 * w, 32);
+    }
+    for (int i = 0; packed == nullptr && i < fragmentLength; i++)
+    {
+        int code = baseCode(fragment[i]);
+        if (code < 0 || code > 3)
+        {
+            m_wordHasN[i >> 5] = true;
+            continue;
+        }
+        m_fragmentWords[i >> 5] |= (uint64_t) code << (2 * (i & 31));
+    }
+    for (int m = 0; m < matches.size(); m++)
+    {
+        m_nameMatch.insert(std::make_pair(matches[m].genomeName, m)); // keeps the first
+    }
+}
+
+// The length of the longest prefix of the fragment that matches g from
+// position on (available bases of it) with at most the allowed mismatches,
+// and none in the first base if firstBaseExact (the seeds see to that unless
+// they came from a reverse complement).
+int GenomeMatcherImpl::MatchCollector::matchingPrefix(const Genome& g, int position, int available, bool firstBaseExact) const
+{
+    int mismatchesLeft = m_exactMatchOnly ? 0 : 1; // in exact mode we've already "found a mismatch" and won't allow for finding another one
+    GenomeView candidate;
+    g.view(position, available, candidate);
+    for (int k = 0; k < available; k += 32) // 32 bases at a time
+    {
+        int count = std::min(32, available - k);
+        if (m_wordHasN[k >> 5] || candidate.containsN(k, count)) // an N packs as A, so only the chars tell
+        {
+            std::string bases;
+            g.extract(position + k, count, bases);
+            for (int i = 0; i < count; i++)
+            {
+                if (bases[i] != m_fragment[k + i] && ((firstBaseExact && k + i == 0) || mismatchesLeft-- == 0))
+                {
+                    return k + i;
+                }
+            }
+            continue;
+        }
+        uint64_t diff = candidate.packedWord(k) ^ m_fragmentWords[k >> 5];
+        uint64_t mismatches = (diff | (diff >> 1)) & 0x5555555555555555ULL; // low bit of each base that differs
+        if (firstBaseExact && k == 0 && (mismatches & 1) != 0)
+        {
+            return 0;
+        }
+        for (; mismatches != 0; mismatches &= mismatches - 1)
+        {
+            if (mismatchesLeft-- == 0)
+            {
+                return std::min(k + __builtin_ctzll(mismatches) / 2, available); // the fragment may run on past the view
+            }
+        }
+    }
+    return available;
+}
+
+// matchingPrefix for the reverse strand: the length of the longest prefix of
+// the fragment whose reverse complement ends at end in g, comparing the
+// fragment with g read backwards from end - 1 (available bases of it). The
+// first base has to match.
+int GenomeMatcherImpl::MatchCollector::matchingReversePrefix(const Genome& g, int end, int available) const
+{
+    int mismatchesLeft = m_exactMatchOnly ? 0 : 1;
+    GenomeView candidate;
+    g.view(end - available, available, candidate);
+    for (int k = 0; k < available; k += 32) // 32 bases at a time, the fragment's [k, k + count) against the candidate's [last - count, last)
+    {
+        int count = std::min(32, available - k);
+        int last = available - k;
+        if (m_wordHasN[k >> 5] || candidate.containsN(last - count, count))
+        {
+            std::string bases;
+            g.extract(end - k - count, count, bases);
+            for (int i = 0; i < count; i++)
+            {
+                if (complement(bases[count - 1 - i]) != m_fragment[k + i] && (k + i == 0 || mismatchesLeft-- == 0))
+                {
+                    return k + i;
+                }
+            }
+            continue;
+        }
+        uint64_t word = last >= 32 ? candidate.packedWord(last - 32) : candidate.packedWord(0) << (2 * (32 - last));
+        uint64_t diff = reversedBases(word) ^ ~m_fragmentWords[k >> 5]; // complementing a base flips both its bits
+        uint64_t mismatches = (diff | (diff >> 1)) & 0x5555555555555555ULL;
+        if (k == 0 && (mismatches & 1) != 0)
+        {
+            return 0;
+        }
+        for (; mismatches != 0; mismatches &= mismatches - 1)
+        {
+            if (mismatchesLeft-- == 0)
+            {
+                return std::min(k + __builtin_ctzll(mismatches) / 2, available);
+            }
+        }
+    }
+    return available;
+}
+
+// Whether g's minimumSearchLength bases from position are their own reverse
+// complement, so that a seed hit there is one on both strands.
+bool GenomeMatcherImpl::MatchCollector::palindromicSeed(const Genome& g, int position) const
+{
+    const int k = m_matcher.minimumSearchLength();
+    GenomeView seed;
+    if (k % 2 != 0 || !g.view(position, k, seed)) // the middle base of an odd k-mer would have to be its own complement
+    {
+        return false;
+    }
+    if (seed.containsN(0, k))
+    {
+        std::string bases;
+        g.extract(position, k, bases);
+        return reverseComplement(bases.data(), k) == bases;
+    }
+    for (int i = 0; i < k / 2; i += 32) // the first half against the second, backwards
+    {
+        int count = std::min(32, k / 2 - i);
+        int last = k - i;
+        uint64_t word = last >= 32 ? seed.packedWord(last - 32) : seed.packedWord(0) << (2 * (32 - last));
+        uint64_t diff = seed.packedWord(i) ^ ~reversedBases(word);
+        if (count < 32)
+        {
+            diff &= ((uint64_t) 1 << (2 * count)) - 1;
+        }
+        if (diff != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GenomeMatcherImpl::MatchCollector::limit(const SearchLimits& limits)
+{
+    m_maxMatches = std::max(limits.maxMatches, 0);
+    m_liveGenomes = (int) std::count(m_matcher.m_removed.begin(), m_matcher.m_removed.end(), (char) false);
+    m_hitsLeft = limits.maxHits > 0 ? limits.maxHits : -1;
+    m_timed = limits.maxMilliseconds > 0;
+    m_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.maxMilliseconds);
+}
+
+bool GenomeMatcherImpl::MatchCollector::wants(long long gathered) const
+{
+    if (m_stopped || (m_hitsLeft > 0 && gathered >= m_hitsLeft))
+    {
+        return false;
+    }
+    return !m_timed || (gathered & 255) != 255 || std::chrono::steady_clock::now() < m_deadline;
+}
+
+bool GenomeMatcherImpl::MatchCollector::add(const genHolder& hit)
+{
+    if (m_stopped)
+    {
+        return false;
+    }
+    if (!m_matcher.m_removed[hit.indexVec])
+    {
+        addCandidate(hit.indexVec, hit.genomePos, hit.reverse != 0);
+        if (m_matcher.m_bothStrands && palindromicSeed(m_matcher.m_genomesVec[hit.indexVec], hit.genomePos))
+        {
+            addCandidate(hit.indexVec, hit.genomePos, hit.reverse == 0);
+        }
+    }
+    m_hitIndex++;
+    
+    // with the top m_maxMatches (or every genome) at full length, no later
+    // hit can get in ahead of them; past that it's only the budget
+    if ((m_maxMatches > 0 && m_fullMatches >= m_maxMatches) || m_fullMatches >= m_liveGenomes || (m_hitsLeft > 0 && --m_hitsLeft == 0) ||
+        (m_timed && (m_hitIndex & 255) == 0 && std::chrono::steady_clock::now() >= m_deadline))
+    {
+        m_stopped = true;
+    }
+    return !m_stopped;
+}
+
+void GenomeMatcherImpl::MatchCollector::addCandidate(int genome, int position, bool reverse)
+{
+    if (m_fullMatches > 0 || m_alreadyInMatches > 0)
+    {
+        std::unordered_map<int, int>::const_iterator known = m_genomeMatch.find(genome);
+        if (known != m_genomeMatch.end() && (known->second < m_alreadyInMatches || m_matches[known->second].length == m_fragmentLength))
+        {
+            return; // nothing this hit could score would change the genome's match
+        }
+    }
+    const Genome& g = m_matcher.m_genomesVec[genome]; // we're finding the genome that corresponds to the curr hit
+    // the longest candidate that matches wins; a candidate can't run past the
+    // end of the genome, or on the reverse strand past its start
+    int length = -1;
+    int start = position;
+    if (!reverse)
+    {
+        int available = std::min(m_fragmentLength, g.length() - position);
+        length = available >= m_minimumLength ? matchingPrefix(g, position, available, m_matcher.m_bothStrands) : -1;
+    }
+    else
+    {
+        int end = position + m_matcher.minimumSearchLength();
+        int available = std::min(m_fragmentLength, end);
+        length = available >= m_minimumLength ? matchingReversePrefix(g, end, available) : -1;
+        start = end - length;
+    }
+    
+    if (length >= m_minimumLength)
+    {
+        // hits are tallied by genome id; a genome's name is only looked at
+        // the first time it matches, to find which entry of m_matches is its
+        std::unordered_map<int, int>::iterator genomeMatch = m_genomeMatch.find(genome);
+        if (genomeMatch == m_genomeMatch.end())
+        {
+            std::unordered_map<std::string, int>::const_iterator nameMatch = m_nameMatch.find(g.name());
+            int entry = nameMatch == m_nameMatch.end() ? (int) m_matches.size() : nameMatch->second;
+            genomeMatch = m_genomeMatch.insert(std::make_pair(genome, entry)).first;
+        }
+        int m = genomeMatch->second;
+        if (m == m_matches.size())
+        {
+            DNAMatch match;
+            match.length = length;
+            match.genomeName = g.name();
+            match.position = start;
+            match.reverseStrand = reverse;
+            m_matches.push_back(match);
+            m_nameMatch.insert(std::make_pair(match.genomeName, m));
+            m_hitOrder.push_back(m_hitIndex);
+            m_matchFound = true;
+            m_fullMatches += length == m_fragmentLength;
+        }
+        else if (m >= m_alreadyInMatches && length > m_matches[m].length) // a longer match for this genome replaces the old one
+        {
+            m_matches[m].length = length;
+            m_matches[m].position = start;
+            m_matches[m].reverseStrand = reverse;
+            m_hitOrder[m - m_alreadyInMatches] = m_hitIndex;
+            m_fullMatches += length == m_fragmentLength;
+        }
+    }
+}
+
+bool GenomeMatcherImpl::MatchCollector::finish()
+{
+    // report the new matches longest first, ties in the order the trie found them
+    std::vector<int>& order = m_buffers.m_order;
+    order.resize(m_hitOrder.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int x, int y)
+    {
+        const DNAMatch& mx = m_matches[m_alreadyInMatches + x];
+        const DNAMatch& my = m_matches[m_alreadyInMatches + y];
+        return mx.length != my.length ? mx.length > my.length : m_hitOrder[x] < m_hitOrder[y];
+    });
+    std::vector<DNAMatch>& sorted = m_buffers.m_sorted;
+    sorted.clear();
+    for (int i = 0; i < order.size(); i++)
+    {
+        sorted.push_back(m_matches[m_alreadyInMatches + order[i]]);
+    }
+    std::copy(sorted.begin(), sorted.end(), m_matches.begin() + m_alreadyInMatches);
+    if (m_maxMatches > 0 && sorted.size() > m_maxMatches)
+    {
+        m_matches.resize(m_alreadyInMatches + m_maxMatches);
+    }
+    return m_matchFound;
+}
+
+// A thread's buffers for matchFragments, reused from one call to the next.
+struct GenomeMatcherImpl::MatchScratch
+{
+    std::vector<int> m_matched; // the fragments long enough to match anything
+    std::vector<SeedTrie::KeyRef> m_seeds;
+    std::vector<MatchCollector> m_collectors;
+    std::vector<MatchCollector::Buffers> m_buffers; // m_collectors[c]'s are m_buffers[c]
+    std::vector<std::vector<SeedTrie::KeyRef>> m_shardKeys; // for findSeedsBatch
+    std::vector<std::vector<int>> m_shardKeyIndex;
+};
+
+// A sequence the fragments given to matchFragments were all cut from, at
+// multiples of m_stride, already packed: the collectors copy each fragment's
+// words out of m_genome instead of packing its bases again. For an exact
+// search of a KmerHash, m_seeds has each fragment's seed as its key (the
+// canonical form's in a strand-aware library), packed by a rolling encoder
+// in one pass along the sequence.
+struct GenomeMatcherImpl::PackedQuery
+{
+    const Genome* m_genome;
+    const char* m_bases; // m_genome's bases, which the fragments point into
+    int m_stride;
+    std::vector<uint64_t> m_seeds;        // by fragment
+    std::vector<char> m_seedComplemented; // the seed's key is its reverse complement's
+    std::vector<char> m_seedPacked;       // false if the seed has anything but A, C, G and T in it, so it's looked up the usual way
+};
+
+// Matches each of the fragments as findGenomesWithThisDNA would, adding to
+// *matches[i] for fragments[i], with all their seeds looked up in one batch.
+// minimumLength must be at least minimumSearchLength().
+void GenomeMatcherImpl::matchFragments(const std::vector<SeedTrie::KeyRef>& fragments, const std::vector<std::vector<DNAMatch>*>& matches, int minimumLength, bool exactMatchOnly, MatchScratch& scratch, const PackedQuery* query) const
+{
+    scratch.m_matched.clear();
+    scratch.m_seeds.clear();
+    scratch.m_collectors.clear();
+    scratch.m_collectors.reserve(fragments.size());
+    if (scratch.m_buffers.size() < fragments.size())
+    {
+        scratch.m_buffers.resize(fragments.size());
+    }
+    for (int i = 0; i < fragments.size(); i++)
+    {
+        if (fragments[i].m_length < minimumLength)
+        {
+            continue;
+        }
+        scratch.m_matched.push_back(i);
+        GenomeView packed;
+        if (query != nullptr)
+        {
+            query->m_genome->view((int) (fragments[i].m_data - query->m_bases), fragments[i].m_length, packed);
+        }
+        scratch.m_collectors.emplace_back(*this, fragments[i].m_data, fragments[i].m_length, minimumLength, exactMatchOnly, *matches[i], scratch.m_buffers[scratch.m_collectors.size()], query != nullptr ? &packed : nullptr);
+        SeedTrie::KeyRef seed;
+        seed.m_data = fragments[i].m_data;
+        seed.m_length = minimumSearchLength();
+        scratch.m_seeds.push_back(seed);
+    }
+    std::vector<MatchCollector>& collectors = scratch.m_collectors;
+    if (query != nullptr && !query->m_seeds.empty())
+    {
+        buildIndex();
+        for (int c = 0; c < collectors.size(); c++)
+        {
+            const char* fragment = fragments[scratch.m_matched[c]].m_data;
+            int f = (int) (fragment - query->m_bases) / query->m_stride;
+            bool complemented = query->m_seedComplemented[f] != 0;
+            auto visit = [&collectors, c, complemented](const genHolder& stored)
+            {
+                genHolder hit = stored;
+                hit.reverse = (stored.reverse != 0) != complemented;
+                return collectors[c].add(hit);
+            };
+            auto add = [&collectors, c](const genHolder& hit) { return collectors[c].add(hit); }; // the lookup sets the strand itself
+            if (query->m_seedPacked[f])
+            {
+                m_kmerHash->find(query->m_seeds[f], visit);
+            }
+            else if (m_bothStrands)
+            {
+                findStrandSeeds(fragment, true, add);
+            }
+            else
+            {
+                findSeeds(fragment, true, add);
+            }
+        }
+    }
+    else if (m_minimizerWindow > 1)
+    {
+        for (int c = 0; c < collectors.size(); c++)
+        {
+            const SeedTrie::KeyRef& fragment = fragments[scratch.m_matched[c]];
+            findSampledSeeds(fragment.m_data, fragment.m_length, minimumLength, exactMatchOnly,
+                             [&collectors, c](long long gathered) { return collectors[c].wants(gathered); },
+                             [&collectors, c](const genHolder& hit) { return collectors[c].add(hit); });
+        }
+    }
+    else if (m_bothStrands) // the lookups depend on which strand comes first, so they aren't batched
+    {
+        for (int c = 0; c < collectors.size(); c++)
+        {
+            findStrandSeeds(fragments[scratch.m_matched[c]].m_data, exactMatchOnly, [&collectors, c](const genHolder& hit) { return collectors[c].add(hit); });
+        }
+    }
+    else
+    {
+        findSeedsBatch(scratch.m_seeds, exactMatchOnly, scratch.m_shardKeys, scratch.m_shardKeyIndex, [&collectors](int c, const genHolder& hit)
+        {
+            collectors[c].add(hit);
+            return true;
+        });
+    }
+    for (int c = 0; c < collectors.size(); c++)
+    {
+        collectors[c].finish();
+    }
+}
+
+bool GenomeMatcherImpl::findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, const SearchLimits& limits, std::vector<DNAMatch>& matches) const
+{
+    if (fragment.size() < minimumLength || minimumLength < minimumSearchLength())
+    {
+        return false;
+    }
+    
+    // look at the hits for the fragment's first minimumSearchLength chars (or SNiPs of them) straight out of the trie
+    MatchCollector::Buffers buffers;
+    MatchCollector collector(*this, fragment.data(), (int) fragment.size(), minimumLength, exactMatchOnly, matches, buffers);
+    collector.limit(limits);
+    auto wanted = [&collector](long long gathered) { return collector.wants(gathered); };
+    auto add = [&collector](const genHolder& hit) { return collector.add(hit); };
+    if (m_minimizerWindow > 1)
+    {
+        findSampledSeeds(fragment.data(), (int) fragment.size(), minimumLength, exactMatchOnly, wanted, add);
+        return collector.finish();
+    }
+    if (m_bothStrands)
+    {
+        findStrandSeeds(fragment.c_str(), exactMatchOnly, add, wanted);
+        return collector.finish();
+    }
+    findSeeds(fragment.c_str(), exactMatchOnly, add, wanted);
+    return collector.finish();
+}
+
+void GenomeMatcherImpl::findGenomesWithThisDNABatch(const std::vector<std::string>& fragments, int minimumLength, bool exactMatchOnly, int threads, std::vector<std::vector<DNAMatch>>& results) const
+{
+    results.assign(fragments.size(), std::vector<DNAMatch>());
+    if (minimumLength < minimumSearchLength())
+    {
+        return;
+    }
+    
+    // fragments are taken in order of their seeds, so each chunk's batch
+    // lookup walks shared seed prefixes (and repeated seeds) only once
+    const int k = minimumSearchLength();
+    std::vector<int> order(fragments.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&fragments, k](int x, int y)
+    {
+        return fragments[x].compare(0, k, fragments[y], 0, k) < 0;
+    });
+    const int kChunkFragments = 256;
+    int chunks = (int) (fragments.size() + kChunkFragments - 1) / kChunkFragments;
+    threads = std::max(1, std::min(threads, chunks));
+    std::vector<MatchScratch> scratch(threads);
+    parallelFor(chunks, threads, [&](int chunk, int worker)
+    {
+        int first = chunk * kChunkFragments;
+        int count = std::min(kChunkFragments, (int) fragments.size() - first);
+        std::vector<SeedTrie::KeyRef> batch(count);
+        std::vector<std::vector<DNAMatch>*> matches(count);
+        for (int i = 0; i < count; i++)
+        {
+            const std::string& fragment = fragments[order[first + i]];
+            batch[i].m_data = fragment.data();
+            batch[i].m_length = (int) fragment.size();
+            matches[i] = &results[order[first + i]];
+        }
+        matchFragments(batch, matches, minimumLength, exactMatchOnly, scratch[worker]);
+    });
+}
+
+bool GenomeMatcherImpl::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results, int threads, int stride) const
+{
+    if (fragmentMatchLength < minimumSearchLength())
+    {
+        return false;
+    }
+    if (stride <= 0)
+    {
+        stride = fragmentMatchLength;
+    }
+    
+    // decode the query once and slide a window along it stride bases at a
+    // time (a short last one can't match anything). Nothing is packed twice:
+    // the windows' words come out of the query's own, and an exact KmerHash
+    // search has every window's seed key rolled up in one pass (unless
+    // genomes added since the hash was built are in the delta tries). Chunks
+    // of windows are matched independently, each worker tallying how many
+    // windows every genome matched in
+    std::string bases;
+    query.extract(0, query.length(), bases);
+    const int windowCount = query.length() >= fragmentMatchLength ? (query.length() - fragmentMatchLength) / stride + 1 : 0;
+    PackedQuery packed;
+    packed.m_genome = &query;
+    packed.m_bases = bases.data();
+    packed.m_stride = stride;
+    if (m_seedIndex == SeedIndex::KmerHash)
+    {
+        buildIndex();
+    }
+    if (m_seedIndex == SeedIndex::KmerHash && exactMatchOnly && windowCount > 0 && m_indexedGenomes == m_genomesVec.size()) // genomes in the delta tries need the usual lookups
+    {
+        const int k = minimumSearchLength();
+        const uint64_t mask = k >= 32 ? UINT64_MAX : ((uint64_t) 1 << (2 * k)) - 1;
+        packed.m_seeds.assign(windowCount, 0);
+        packed.m_seedComplemented.assign(windowCount, false);
+        packed.m_seedPacked.assign(windowCount, false);
+        uint64_t kmer = 0;
+        uint64_t reverseKmer = 0;
+        int lastInvalid = -1;
+        for (int i = 0; i < (int) bases.size(); i++)
+        {
+            int code = baseCode(bases[i]);
+            if (code < 0 || code > 3)
+            {
+                lastInvalid = i;
+            }
+            kmer = ((kmer << 2) | (code & 3)) & mask;
+            reverseKmer = (reverseKmer >> 2) | ((uint64_t) (3 - (code & 3)) << (2 * (k - 1)));
+            int start = i - k + 1;
+            if (start < 0 || start % stride != 0 || start / stride >= windowCount)
+            {
+                continue;
+            }
+            int w = start / stride;
+            bool complemented = m_bothStrands && reverseKmer < kmer;
+            packed.m_seeds[w] = complemented ? reverseKmer : kmer;
+            packed.m_seedComplemented[w] = complemented;
+            packed.m_seedPacked[w] = lastInvalid < start;
+        }
+    }
+    const int kChunkWindows = 256; // enough to share seed lookups, few enough to spread over threads
+    int chunks = (windowCount + kChunkWindows - 1) / kChunkWindows;
+    threads = std::max(1, std::min(threads, chunks));
+    std::vector<std::unordered_map<std::string, int>> windowsMatched(threads); // per worker, by genome name
+    std::vector<MatchScratch> scratch(threads);
+    parallelFor(chunks, threads, [&](int chunk, int worker)
+    {
+        int first = chunk * kChunkWindows;
+        int count = std::min(kChunkWindows, windowCount - first);
+        std::vector<std::vector<DNAMatch>> windowMatches(count);
+        std::vector<SeedTrie::KeyRef> windows(count);
+        std::vector<std::vector<DNAMatch>*> matches(count);
+        for (int w = 0; w < count; w++)
+        {
+            windows[w].m_data = bases.data() + (size_t) (first + w) * stride;
+            windows[w].m_length = fragmentMatchLength;
+            matches[w] = &windowMatches[w];
+        }
+        matchFragments(windows, matches, fragmentMatchLength, exactMatchOnly, scratch[worker], &packed);
+        std::unordered_map<std::string, int>& tally = windowsMatched[worker];
+        for (int w = 0; w < count; w++)
+        {
+            for (int j = 0; j < windowMatches[w].size(); j++) // one match per genome name
+            {
+                tally[windowMatches[w][j].genomeName]++;
+            }
+        }
+    });
+    
+    for (int t = 1; t < threads; t++)
+    {
+        for (std::unordered_map<std::string, int>::const_iterator p = windowsMatched[t].begin(); p != windowsMatched[t].end(); p++)
+        {
+            windowsMatched[0][p->first] += p->second;
+        }
+    }
+    std::vector<GenomeMatch> related;
+    for (std::unordered_map<std::string, int>::const_iterator p = windowsMatched[0].begin(); p != windowsMatched[0].end(); p++)
+    {
+        double percent = 100.0 * p->second / windowCount;
+        if (percent >= matchPercentThreshold) // add to our vector
+        {
+            GenomeMatch match;
+            match.genomeName = p->first;
+            match.percentMatch = percent;
+            related.push_back(match);
+        }
+    }
+    std::sort(related.begin(), related.end(), [](const GenomeMatch& x, const GenomeMatch& y) // most related first, then by name
+    {
+        return x.percentMatch != y.percentMatch ? x.percentMatch > y.percentMatch : x.genomeName < y.genomeName;
+    });
+    results.insert(results.end(), related.begin(), related.end());
+    
+    if (related.empty())
+        return false;
+    return true;
+}
+
+// Index image layout: an IndexImageHeader, one IndexImageGenome per genome
+// (removed ones included, so ids survive),
+// the genomes' names, their packed bases (see Genome::saveImage), each shard
+// trie's own image (see Trie::save)
+// or else the FM-index's or k-mer hash's followed by any delta tries', and
+// finally those images' offsets, every section starting on an 8-byte boundary.
+const char kIndexImageMagic[8] = { 'G', 'E', 'E', 'N', 'O', 'M', 'I', 'X' };
+const uint32_t kIndexImageVersion = 9;
+
+struct IndexImageHeader
+{
+    char m_magic[8];
+    uint32_t m_version;
+    int32_t m_minSearchLength;
+    int32_t m_minimizerWindow;
+    int32_t m_bothStrands;
+    uint64_t m_genomeCount;
+    uint64_t m_seedIndex;   // a SeedIndex
+    uint64_t m_shardCount;  // seed index images: one per trie shard, the FM-index, or the k-mer hash and its N trie, then the delta tries
+    uint64_t m_shardTableOffset;
+    uint64_t m_indexedGenomes; // those the FM-index or k-mer hash covers; the rest are in the delta tries
+};
+
+struct IndexImageGenome
+{
+    uint64_t m_nameOffset;
+    uint64_t m_nameLength;
+    uint64_t m_sequenceOffset;
+    uint64_t m_sequenceLength; // in bases
+    uint64_t m_sequenceBytes;  // of packed words and runs
+    uint64_t m_state;       // 0 in the library, 1 removed but still in the seed index
+};
+
+static uint64_t imageAlign(uint64_t bytes)
+{
+    return (bytes + 7) & ~(uint64_t) 7;
+}
+
+bool GenomeMatcherImpl::saveIndex(const std::string& filename) const
+{
+    // the image goes in a file of its own and is renamed over filename once
+    // it's complete, so an image this library has mapped (even filename
+    // itself) stays whole: the mapping keeps the replaced file alive
+    const std::string temporary = filename + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        return false;
+    }
+    
+    // lay out the genome table first so every offset is known before writing
+    std::vector<IndexImageGenome> table(m_genomesVec.size());
+    uint64_t offset = sizeof(IndexImageHeader) + table.size() * sizeof(IndexImageGenome);
+    for (int i = 0; i < m_genomesVec.size(); i++)
+    {
+        table[i].m_nameOffset = offset;
+        table[i].m_nameLength = m_genomesVec[i].name().size();
+        offset += table[i].m_nameLength;
+        table[i].m_state = m_removed[i] ? 1 : 0;
+    }
+    offset = imageAlign(offset);
+    for (int i = 0; i < m_genomesVec.size(); i++)
+    {
+        table[i].m_sequenceOffset = offset;
+        table[i].m_sequenceLength = m_genomesVec[i].length();
+        table[i].m_sequenceBytes = m_genomesVec[i].imageSize();
+        offset += table[i].m_sequenceBytes;
+    }
+    const std::vector<std::unique_ptr<SeedTrie>> noDelta;
+    if (m_seedIndex != SeedIndex::KmerTrie)
+    {
+        buildIndex();
+    }
+    const std::vector<std::unique_ptr<SeedTrie>>& delta = m_seedIndex != SeedIndex::KmerTrie ? m_delta : noDelta; // a minimizer trie's FM-index isn't saved
+    
+    IndexImageHeader header;
+    std::memcpy(header.m_magic, kIndexImageMagic, sizeof(header.m_magic));
+    header.m_version = kIndexImageVersion;
+    header.m_minSearchLength = m_minSearchLength;
+    header.m_minimizerWindow = m_minimizerWindow;
+    header.m_bothStrands = m_bothStrands;
+    header.m_genomeCount = m_genomesVec.size();
+    header.m_seedIndex = (uint64_t) m_seedIndex;
+    header.m_shardCount = (m_seedIndex == SeedIndex::FMIndex ? 1 : m_seedIndex == SeedIndex::KmerHash ? 2 : m_shards.size()) + delta.size();
+    header.m_shardTableOffset = 0; // filled in once the shards are written
+    header.m_indexedGenomes = m_seedIndex != SeedIndex::KmerTrie ? m_indexedGenomes : 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(IndexImageGenome));
+    uint64_t names = sizeof(IndexImageHeader) + table.size() * sizeof(IndexImageGenome);
+    for (int i = 0; i < m_genomesVec.size(); i++)
+    {
+        out << m_genomesVec[i].name();
+        names += table[i].m_nameLength;
+    }
+    const char padding[8] = { 0 };
+    out.write(padding, imageAlign(names) - names);
+    for (int i = 0; i < m_genomesVec.size(); i++)
+    {
+        m_genomesVec[i].saveImage(out);
+    }
+    std::vector<uint64_t> shardOffsets;
+    if (m_seedIndex == SeedIndex::FMIndex)
+    {
+        shardOffsets.push_back((uint64_t) out.tellp());
+        fmIndex().save(out);
+    }
+    if (m_seedIndex == SeedIndex::KmerHash)
+    {
+        shardOffsets.push_back((uint64_t) out.tellp());
+        m_kmerHash->save(out);
+        shardOffsets.push_back((uint64_t) out.tellp());
+        m_nKmers->save(out);
+    }
+    for (int i = 0; i < m_shards.size(); i++)
+    {
+        shardOffsets.push_back((uint64_t) out.tellp());
+        m_shards[i]->save(out);
+    }
+    for (int i = 0; i < delta.size(); i++)
+    {
+        shardOffsets.push_back((uint64_t) out.tellp());
+        delta[i]->save(out);
+    }
+    header.m_shardTableOffset = (uint64_t) out.tellp();
+    out.write(reinterpret_cast<const char*>(shardOffsets.data()), shardOffsets.size() * sizeof(uint64_t));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    if (!out || std::rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool GenomeMatcherImpl::openIndex(const std::string& filename)
+{
+    std::shared_ptr<MappedFile> image = std::make_shared<MappedFile>();
+    if (!image->open(filename) || image->size() < sizeof(IndexImageHeader))
+    {
+        return false;
+    }
+    const char* data = image->data();
+    IndexImageHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.m_magic, kIndexImageMagic, sizeof(header.m_magic)) != 0 || header.m_version != kIndexImageVersion ||
+        header.m_genomeCount > (image->size() - sizeof(header)) / sizeof(IndexImageGenome) ||
+        header.m_seedIndex > (uint64_t) SeedIndex::KmerHash || header.m_minimizerWindow < 1 || header.m_bothStrands < 0 || header.m_bothStrands > 1 ||
+        (header.m_seedIndex == (uint64_t) SeedIndex::KmerHash && header.m_minSearchLength > 32))
+    {
+        return false;
+    }
+    SeedIndex seedIndex = (SeedIndex) header.m_seedIndex;
+    std::vector<std::unique_ptr<SeedTrie>> shards;
+    if (seedIndex == SeedIndex::KmerTrie)
+    {
+        shards = makeShards(header.m_minSearchLength);
+    }
+    size_t seedImages = seedIndex == SeedIndex::FMIndex ? 1 : seedIndex == SeedIndex::KmerHash ? 2 : shards.size();
+    std::vector<std::unique_ptr<SeedTrie>> delta;
+    if (header.m_indexedGenomes < header.m_genomeCount && seedIndex != SeedIndex::KmerTrie)
+    {
+        delta = makeShards(header.m_minSearchLength);
+    }
+    if (header.m_shardCount != seedImages + delta.size() || header.m_shardTableOffset + header.m_shardCount * sizeof(uint64_t) > image->size() ||
+        header.m_indexedGenomes > header.m_genomeCount || (seedIndex == SeedIndex::KmerTrie && header.m_indexedGenomes != 0))
+    {
+        return false;
+    }
+    
+    const IndexImageGenome* table = reinterpret_cast<const IndexImageGenome*>(data + sizeof(header));
+    std::vector<Genome> genomes;
+    std::vector<char> removed;
+    genomes.reserve(header.m_genomeCount);
+    for (uint64_t i = 0; i < header.m_genomeCount; i++)
+    {
+        if (table[i].m_nameOffset + table[i].m_nameLength > image->size() || table[i].m_sequenceLength > INT_MAX || table[i].m_state > 1 ||
+            !Genome::attachImage(std::string(data + table[i].m_nameOffset, table[i].m_nameLength), (int) table[i].m_sequenceLength,
+                                 image, table[i].m_sequenceOffset, table[i].m_sequenceBytes, genomes))
+        {
+            return false;
+        }
+        removed.push_back(table[i].m_state != 0);
+    }
+    
+    // the shard tries, FM-index or k-mer hash are used in place; nothing is rebuilt
+    const uint64_t* shardOffsets = reinterpret_cast<const uint64_t*>(data + header.m_shardTableOffset);
+    std::unique_ptr<FMIndex> fm;
+    if (seedIndex == SeedIndex::FMIndex)
+    {
+        fm.reset(new FMIndex);
+        if (shardOffsets[0] > header.m_shardTableOffset || !fm->attach(data + shardOffsets[0], header.m_shardTableOffset - shardOffsets[0]))
+        {
+            return false;
+        }
+    }
+    std::unique_ptr<KmerHash<genHolder>> hash;
+    std::unique_ptr<SeedTrie> nKmers;
+    if (seedIndex == SeedIndex::KmerHash)
+    {
+        hash.reset(new KmerHash<genHolder>);
+        nKmers.reset(new SeedTrie(header.m_minSearchLength > kCompressPathsAbove));
+        if (shardOffsets[0] > shardOffsets[1] || shardOffsets[1] > header.m_shardTableOffset ||
+            !hash->attach(data + shardOffsets[0], shardOffsets[1] - shardOffsets[0]) || !nKmers->attach(data + shardOffsets[1], header.m_shardTableOffset - shardOffsets[1]))
+        {
+            return false;
+        }
+    }
+    for (int i = 0; i < shards.size(); i++)
+    {
+        if (shardOffsets[i] > header.m_shardTableOffset || !shards[i]->attach(data + shardOffsets[i], header.m_shardTableOffset - shardOffsets[i]))
+        {
+            return false;
+        }
+    }
+    for (int i = 0; i < delta.size(); i++)
+    {
+        uint64_t at = shardOffsets[seedImages + i];
+        if (at > header.m_shardTableOffset || !delta[i]->attach(data + at, header.m_shardTableOffset - at))
+        {
+            return false;
+        }
+    }
+    m_minSearchLength = header.m_minSearchLength;
+    m_seedIndex = seedIndex;
+    m_minimizerWindow = header.m_minimizerWindow;
+    m_bothStrands = header.m_bothStrands != 0;
+    m_shards.swap(shards);
+    m_fmIndex.swap(fm);
+    m_kmerHash.swap(hash);
+    m_nKmers.swap(nKmers);
+    m_delta.swap(delta);
+    m_indexBuilt = m_seedIndex != SeedIndex::KmerTrie;
+    m_indexedGenomes = (int) header.m_indexedGenomes;
+    m_genomesVec.swap(genomes);
+    m_removed.swap(removed);
+    m_image = image;
+    return true;
+}
+
+//******************** GenomeMatcher functions ********************************
+
+// These functions simply delegate to GenomeMatcherImpl's functions.
+// You probably don't want to change any of this code.
+
+GenomeMatcher::GenomeMatcher(int minSearchLength, SeedIndex seedIndex, int minimizerWindow, bool bothStrands)
+{
+    m_impl = new GenomeMatcherImpl(minSearchLength, seedIndex, minimizerWindow, bothStrands);
+}
+
+GenomeMatcher::~GenomeMatcher()
+{
+    delete m_impl;
+}
+
+void GenomeMatcher::addGenome(const Genome& genome)
+{
+    m_impl->addGenome(genome);
+}
+
+void GenomeMatcher::addGenomes(const std::vector<Genome>& genomes, int threads)
+{
+    m_impl->addGenomes(genomes, threads);
+}
+
+void GenomeMatcher::loadFiles(const std::vector<std::string>& filenames, int threads, std::vector<LoadedFile>& results)
+{
+    m_impl->loadFiles(filenames, threads, results);
+}
+
+bool GenomeMatcher::removeGenome(const std::string& name)
+{
+    return m_impl->removeGenome(name);
+}
+
+bool GenomeMatcher::replaceGenome(const Genome& genome)
+{
+    return m_impl->replaceGenome(genome);
+}
+
+void GenomeMatcher::compact()
+{
+    m_impl->compact();
+}
+
+int GenomeMatcher::minimumSearchLength() const
+{
+    return m_impl->minimumSearchLength();
+}
+
+bool GenomeMatcher::findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const
+{
+    return m_impl->findGenomesWithThisDNA(fragment, minimumLength, exactMatchOnly, SearchLimits(), matches);
+}
+
+bool GenomeMatcher::findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, const SearchLimits& limits, std::vector<DNAMatch>& matches) const
+{
+    return m_impl->findGenomesWithThisDNA(fragment, minimumLength, exactMatchOnly, limits, matches);
+}
+
+void GenomeMatcher::findGenomesWithThisDNABatch(const std::vector<std::string>& fragments, int minimumLength, bool exactMatchOnly, int threads, std::vector<std::vector<DNAMatch>>& results) const
+{
+    m_impl->findGenomesWithThisDNABatch(fragments, minimumLength, exactMatchOnly, threads, results);
+}
+
+bool GenomeMatcher::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results, int threads, int stride) const
+{
+    return m_impl->findRelatedGenomes(query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results, threads, stride);
+}
+
+
+bool GenomeMatcher::saveIndex(const std::string& filename) const
 {
-    return m_impl->findGenomesWithThisDNA(fragment, minimumLength, exactMatchOnly, matches);
+    return m_impl->saveIndex(filename);
 }
 
-bool GenomeMatcher::findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results) const
+bool GenomeMatcher::openIndex(const std::string& filename)
 {
-    return m_impl->findRelatedGenomes(query, fragmentMatchLength, exactMatchOnly, matchPercentThreshold, results);
+    return m_impl->openIndex(filename);
 }
@@ -0,0 +1,263 @@
+//
+//  KmerHash.h
+//  Project4
+//
+//  A flat open-addressing hash table from k-mers packed 2 bits a base (so
+//  k <= 32) to the values stored with them, which sit in one contiguous
+//  array grouped by k-mer. An exact lookup costs a probe or two instead of a
+//  walk down k trie nodes.
+//
+
+#ifndef KMERHASH_INCLUDED
+#define KMERHASH_INCLUDED
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+template<typename ValueType>
+class KmerHash
+{
+public:
+    KmerHash();
+    // Building takes two passes over the same k-mers in the same order:
+    // count() each one, layout(), then place() each one's value. A k-mer's
+    // values are found in the order they were placed. Anything built or
+    // attached before is dropped by the first count().
+    void count(uint64_t kmer);
+    void layout();
+    void place(uint64_t kmer, const ValueType& value);
+    // Calls visit(const ValueType&) for each of the k-mer's values. visit
+    // returns false to stop, in which case find returns false too.
+    template<typename Visit>
+    bool find(uint64_t kmer, Visit visit) const;
+
+    // Index images, as for Trie: save() writes a flat block that attach() can
+    // use in place (e.g. out of a memory-mapped file) while it stays valid.
+    void save(std::ostream& out) const;
+    bool attach(const char* image, size_t size);
+
+    KmerHash(const KmerHash&) = delete;
+    KmerHash& operator=(const KmerHash&) = delete;
+private:
+    static_assert(std::is_trivially_copyable<ValueType>::value, "values are saved as raw bytes");
+    static const uint32_t kEmpty = UINT32_MAX; // m_first of a slot no k-mer has
+    static const uint64_t kInitialSlots = 1024; // a power of 2, as the slot count always is
+
+    struct Slot
+    {
+        uint64_t m_kmer;
+        uint32_t m_first; // where the k-mer's values start in m_values
+        uint32_t m_count;
+    };
+
+    struct ImageHeader
+    {
+        uint64_t m_slotCount;
+        uint64_t m_valueCount;
+        uint32_t m_slotSize;
+        uint32_t m_valueSize;
+    };
+
+    static uint64_t hash(uint64_t kmer);
+    static size_t imageAlign(size_t bytes) { return (bytes + 7) & ~(size_t) 7; }
+    const Slot* lookup(uint64_t kmer) const; // nullptr if it isn't there
+    void grow();
+
+    std::vector<Slot> m_ownedSlots;
+    std::vector<ValueType> m_ownedValues;
+    const Slot* m_slots;        // the owned vectors', or an attached image's
+    const ValueType* m_values;
+    uint64_t m_slotCount;
+    uint64_t m_valueCount;
+    uint64_t m_used;            // slots holding a k-mer
+    bool m_counting;            // between the first count() and layout()
+};
+
+template<typename ValueType>
+KmerHash<ValueType>::KmerHash() : m_slots(nullptr), m_values(nullptr), m_slotCount(0), m_valueCount(0), m_used(0), m_counting(false)
+{
+}
+
+template<typename ValueType>
+uint64_t KmerHash<ValueType>::hash(uint64_t kmer) // the splitmix64 finish, so similar k-mers spread out
+{
+    kmer = (kmer ^ (kmer >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    kmer = (kmer ^ (kmer >> 27)) * 0x94d049bb133111ebULL;
+    return kmer ^ (kmer >> 31);
+}
+
+template<typename ValueType>
+const typename KmerHash<ValueType>::Slot* KmerHash<ValueType>::lookup(uint64_t kmer) const
+{
+    if (m_slotCount == 0)
+    {
+        return nullptr;
+    }
+    for (uint64_t i = hash(kmer) & (m_slotCount - 1); ; i = (i + 1) & (m_slotCount - 1)) // linear probing; the table is never full
+    {
+        const Slot& slot = m_slots[i];
+        if (slot.m_first == kEmpty)
+        {
+            return nullptr;
+        }
+        if (slot.m_kmer == kmer)
+        {
+            return &slot;
+        }
+    }
+}
+
+template<typename ValueType>
+void KmerHash<ValueType>::grow()
+{
+    std::vector<Slot> old;
+    old.swap(m_ownedSlots);
+    m_slotCount = old.empty() ? kInitialSlots : 2 * old.size();
+    Slot empty = { 0, kEmpty, 0 };
+    m_ownedSlots.assign(m_slotCount, empty);
+    m_slots = m_ownedSlots.data();
+    for (size_t s = 0; s < old.size(); s++)
+    {
+        if (old[s].m_first == kEmpty)
+        {
+            continue;
+        }
+        uint64_t i = hash(old[s].m_kmer) & (m_slotCount - 1);
+        while (m_ownedSlots[i].m_first != kEmpty)
+        {
+            i = (i + 1) & (m_slotCount - 1);
+        }
+        m_ownedSlots[i] = old[s];
+    }
+}
+
+template<typename ValueType>
+void KmerHash<ValueType>::count(uint64_t kmer)
+{
+    if (!m_counting) // start over
+    {
+        m_ownedSlots.clear();
+        m_ownedValues.clear();
+        m_slotCount = 0;
+        m_valueCount = 0;
+        m_used = 0;
+        m_values = nullptr;
+        m_counting = true;
+        grow();
+    }
+    if (2 * (m_used + 1) > m_slotCount) // keep at least half the slots empty so probes stay short
+    {
+        grow();
+    }
+    uint64_t i = hash(kmer) & (m_slotCount - 1);
+    while (m_ownedSlots[i].m_first != kEmpty && m_ownedSlots[i].m_kmer != kmer)
+    {
+        i = (i + 1) & (m_slotCount - 1);
+    }
+    Slot& slot = m_ownedSlots[i];
+    if (slot.m_first == kEmpty)
+    {
+        slot.m_kmer = kmer;
+        slot.m_first = 0; // taken; where its values go is settled by layout()
+        m_used++;
+    }
+    slot.m_count++;
+    m_valueCount++;
+}
+
+template<typename ValueType>
+void KmerHash<ValueType>::layout()
+{
+    // each k-mer's values get the next run of the array; its count is then
+    // built back up by place() as it fills the run in
+    uint32_t next = 0;
+    for (size_t s = 0; s < m_ownedSlots.size(); s++)
+    {
+        Slot& slot = m_ownedSlots[s];
+        if (slot.m_first != kEmpty)
+        {
+            slot.m_first = next;
+            next += slot.m_count;
+            slot.m_count = 0;
+        }
+    }
+    m_ownedValues.resize(m_valueCount);
+    m_values = m_ownedValues.data();
+    m_counting = false;
+}
+
+template<typename ValueType>
+void KmerHash<ValueType>::place(uint64_t kmer, const ValueType& value)
+{
+    Slot& slot = const_cast<Slot&>(*lookup(kmer)); // it was counted, so it's in a slot we own
+    m_ownedValues[slot.m_first + slot.m_count] = value;
+    slot.m_count++;
+}
+
+template<typename ValueType>
+template<typename Visit>
+bool KmerHash<ValueType>::find(uint64_t kmer, Visit visit) const
+{
+    const Slot* slot = lookup(kmer);
+    if (slot == nullptr)
+    {
+        return true;
+    }
+    for (uint32_t i = slot->m_first; i < slot->m_first + slot->m_count; i++)
+    {
+        if (!visit(m_values[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename ValueType>
+void KmerHash<ValueType>::save(std::ostream& out) const
+{
+    static const char padding[8] = { 0 };
+    ImageHeader header = ImageHeader();
+    header.m_slotCount = m_slotCount;
+    header.m_valueCount = m_valueCount;
+    header.m_slotSize = sizeof(Slot);
+    header.m_valueSize = sizeof(ValueType);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(padding, imageAlign(sizeof(header)) - sizeof(header));
+    out.write(reinterpret_cast<const char*>(m_slots), m_slotCount * sizeof(Slot));
+    out.write(reinterpret_cast<const char*>(m_values), m_valueCount * sizeof(ValueType));
+    out.write(padding, imageAlign(m_valueCount * sizeof(ValueType)) - m_valueCount * sizeof(ValueType));
+}
+
+template<typename ValueType>
+bool KmerHash<ValueType>::attach(const char* image, size_t size)
+{
+    ImageHeader header;
+    if (size < imageAlign(sizeof(header)))
+    {
+        return false;
+    }
+    std::memcpy(&header, image, sizeof(header));
+    if (header.m_slotSize != sizeof(Slot) || header.m_valueSize != sizeof(ValueType) || (header.m_slotCount & (header.m_slotCount - 1)) != 0 ||
+        header.m_valueCount >= kEmpty || header.m_slotCount > size / sizeof(Slot) ||
+        size < imageAlign(sizeof(header)) + header.m_slotCount * sizeof(Slot) + imageAlign(header.m_valueCount * sizeof(ValueType)))
+    {
+        return false; // written by a different build, or cut short
+    }
+    const char* slots = image + imageAlign(sizeof(header));
+    m_ownedSlots.clear();
+    m_ownedValues.clear();
+    m_slotCount = header.m_slotCount;
+    m_valueCount = header.m_valueCount;
+    m_used = 0; // only needed while counting
+    m_counting = false;
+    m_slots = reinterpret_cast<const Slot*>(slots);
+    m_values = reinterpret_cast<const ValueType*>(slots + m_slotCount * sizeof(Slot));
+    return true;
+}
+
+#endif // KMERHASH_INCLUDED
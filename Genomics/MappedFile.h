@@ -0,0 +1,101 @@
+//
+//  MappedFile.h
+//  Project4
+//
+//  Read-only view of a whole file. On POSIX systems the file is memory-mapped,
+//  so its pages come straight from the page cache and are shared by every
+//  process that maps the same file; elsewhere it is read into memory.
+//
+
+#ifndef MAPPEDFILE_INCLUDED
+#define MAPPEDFILE_INCLUDED
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstddef>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class MappedFile
+{
+public:
+    MappedFile() : m_data(nullptr), m_size(0), m_mapped(false) {}
+    ~MappedFile()
+    {
+        close();
+    }
+    bool open(const std::string& filename)
+    {
+        close();
+#if !defined(_WIN32)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        m_size = (size_t) info.st_size;
+        if (m_size > 0)
+        {
+            void* mapping = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                ::close(fd);
+                m_size = 0;
+                return false;
+            }
+            m_data = static_cast<const char*>(mapping);
+            m_mapped = true;
+        }
+        ::close(fd); // the mapping keeps the file open
+        return true;
+#else
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+        m_buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+        return true;
+#endif
+    }
+    void close()
+    {
+#if !defined(_WIN32)
+        if (m_mapped)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+#endif
+        m_buffer.clear();
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+    }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+private:
+    const char* m_data;
+    size_t m_size;
+    bool m_mapped;
+    std::vector<char> m_buffer; // the file's contents where it can't be mapped
+};
+
+#endif // MAPPEDFILE_INCLUDED
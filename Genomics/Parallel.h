@@ -0,0 +1,61 @@
+//
+//  Parallel.h
+//  Project4
+//
+//  Minimal helpers for spreading independent work items over threads.
+//
+
+#ifndef PARALLEL_INCLUDED
+#define PARALLEL_INCLUDED
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+// Number of threads worth using on this machine (at least 1).
+inline int hardwareThreads()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : (int) n;
+}
+
+// Runs task(i, worker) for every i in [0, count) on up to threads threads.
+// Items are handed out one at a time as threads free up; worker (0 to
+// threads - 1) identifies the thread, for per-thread scratch state. With
+// threads <= 1 everything runs on the calling thread, in order.
+template<typename Task>
+void parallelFor(int count, int threads, Task task)
+{
+    if (threads > count)
+    {
+        threads = count;
+    }
+    if (threads <= 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            task(i, 0);
+        }
+        return;
+    }
+    std::atomic<int> next(0);
+    auto work = [&](int worker)
+    {
+        for (int i = next++; i < count; i = next++)
+        {
+            task(i, worker);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int w = 1; w < threads; w++)
+    {
+        pool.emplace_back(work, w);
+    }
+    work(0);
+    for (int w = 0; w < pool.size(); w++)
+    {
+        pool[w].join();
+    }
+}
+
+#endif // PARALLEL_INCLUDED
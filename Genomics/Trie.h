@@ -12,135 +12,951 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
 
-template<typename ValueType>
+// Slab arena: objects are handed out by 32-bit id from fixed-size chunks, so
+// allocation is a bump of a counter and everything is released at once by
+// dropping the chunks. Addresses never move once allocated. An id that's
+// released on its own is handed out again by a later allocate().
+//
+// An arena can also be attached to items laid out contiguously elsewhere (a
+// memory-mapped index image); it then reads them in place until detach()
+// copies them into chunks of its own.
+template<typename T>
+class SlabArena
+{
+public:
+    SlabArena() : m_size(0), m_attached(false) {}
+    uint32_t allocate()
+    {
+        if (m_attached)
+        {
+            detach();
+        }
+        if (!m_free.empty())
+        {
+            uint32_t id = m_free.back();
+            m_free.pop_back();
+            return id;
+        }
+        if ((m_size & kChunkMask) == 0)
+        {
+            m_owned.push_back(std::unique_ptr<T[]>(new T[kChunkSize]));
+            m_chunks.push_back(m_owned.back().get());
+        }
+        return m_size++;
+    }
+    void release(uint32_t id) // the item must not be used again; nothing is destroyed
+    {
+        if (m_attached)
+        {
+            detach();
+        }
+        m_free.push_back(id);
+    }
+    T& operator[](uint32_t id) { return m_chunks[id >> kChunkShift][id & kChunkMask]; }
+    const T& operator[](uint32_t id) const { return m_chunks[id >> kChunkShift][id & kChunkMask]; }
+    uint32_t size() const { return m_size; }
+    bool attached() const { return m_attached; }
+    void swap(SlabArena& other)
+    {
+        m_chunks.swap(other.m_chunks);
+        m_owned.swap(other.m_owned);
+        m_free.swap(other.m_free);
+        std::swap(m_size, other.m_size);
+        std::swap(m_attached, other.m_attached);
+    }
+    void clear()
+    {
+        m_chunks.clear();
+        m_owned.clear();
+        m_free.clear();
+        m_size = 0;
+        m_attached = false;
+    }
+    void attach(const T* items, uint32_t count)
+    {
+        clear();
+        for (uint32_t i = 0; i < count; i += kChunkSize)
+        {
+            m_chunks.push_back(const_cast<T*>(items + i)); // never written through while attached
+        }
+        m_size = count;
+        m_attached = true;
+    }
+    void detach()
+    {
+        std::vector<T*> attachedChunks;
+        attachedChunks.swap(m_chunks);
+        for (uint32_t i = 0; i < m_size; i += kChunkSize)
+        {
+            uint32_t count = m_size - i < kChunkSize ? m_size - i : kChunkSize;
+            m_owned.push_back(std::unique_ptr<T[]>(new T[kChunkSize]));
+            std::copy(attachedChunks[i >> kChunkShift], attachedChunks[i >> kChunkShift] + count, m_owned.back().get());
+            m_chunks.push_back(m_owned.back().get());
+        }
+        m_attached = false;
+    }
+    void save(std::ostream& out) const // the items as raw bytes, contiguously; attach() reads them back
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "arena items are saved as raw bytes");
+        for (uint32_t i = 0; i < m_size; i += kChunkSize)
+        {
+            uint32_t count = m_size - i < kChunkSize ? m_size - i : kChunkSize;
+            out.write(reinterpret_cast<const char*>(m_chunks[i >> kChunkShift]), count * sizeof(T));
+        }
+    }
+
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+private:
+    static const int kChunkShift = 12;
+    static const uint32_t kChunkSize = 1u << kChunkShift;
+    static const uint32_t kChunkMask = kChunkSize - 1;
+    std::vector<T*> m_chunks;
+    std::vector<std::unique_ptr<T[]>> m_owned;
+    std::vector<uint32_t> m_free; // released ids (not saved in images; they just go unused there)
+    uint32_t m_size;
+    bool m_attached;
+};
+
+// Child storage policies. A policy is the per-node record of a node's children
+// (as arena ids); it decides how the child with a given label is located.
+// Id 0 is the root, which is never anyone's child, so 0 means "no child".
+
+// General-purpose policy: children form a sibling list and are found by scanning labels.
+template<typename NodeType>
+struct LabelScanChildren
+{
+    uint32_t m_firstChild = 0;
+    uint32_t m_nextSibling = 0;
+
+    static bool canHold(char)
+    {
+        return true;
+    }
+
+    uint32_t child(char label, const SlabArena<NodeType>& nodes) const
+    {
+        for (uint32_t c = m_firstChild; c != 0; c = nodes[c].m_children.m_nextSibling)
+        {
+            if (nodes[c].m_label == label)
+            {
+                return c;
+            }
+        }
+        return 0;
+    }
+    bool addChild(char label, uint32_t node, SlabArena<NodeType>& nodes)
+    {
+        if (m_firstChild == 0)
+        {
+            m_firstChild = node;
+            return true;
+        }
+        uint32_t last = m_firstChild; // append so children are visited in insertion order
+        while (nodes[last].m_children.m_nextSibling != 0)
+        {
+            last = nodes[last].m_children.m_nextSibling;
+        }
+        nodes[last].m_children.m_nextSibling = node;
+        return true;
+    }
+    void moveChildrenTo(LabelScanChildren& dest) // the sibling link stays with this node
+    {
+        dest.m_firstChild = m_firstChild;
+        m_firstChild = 0;
+    }
+    template<typename Visit>
+    bool forEach(Visit visit, const SlabArena<NodeType>& nodes) const // stops early, returning false, once visit does
+    {
+        for (uint32_t c = m_firstChild; c != 0; c = nodes[c].m_children.m_nextSibling)
+        {
+            if (!visit(c))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// DNA policy: one fixed slot per base (A, C, G, T, N), so finding a child is a
+// single array index instead of a label scan. Labels other than the uppercase
+// bases cannot be stored; inserting a key containing one is a no-op.
+// Children are visited in slot order, not the order they were added, so a
+// mismatching find reaches values branch by branch in A, C, G, T, N order.
+template<typename NodeType>
+struct DNAChildren
+{
+    uint32_t m_slots[5] = { 0, 0, 0, 0, 0 };
+
+    static int slot(char label)
+    {
+        switch (label)
+        {
+            case 'A': return 0;
+            case 'C': return 1;
+            case 'G': return 2;
+            case 'T': return 3;
+            case 'N': return 4;
+            default: return -1;
+        }
+    }
+    static bool canHold(char label)
+    {
+        return slot(label) >= 0;
+    }
+    uint32_t child(char label, const SlabArena<NodeType>&) const
+    {
+        int s = slot(label);
+        return s < 0 ? 0 : m_slots[s];
+    }
+    bool addChild(char label, uint32_t node, SlabArena<NodeType>&)
+    {
+        int s = slot(label);
+        if (s < 0)
+        {
+            return false;
+        }
+        m_slots[s] = node;
+        return true;
+    }
+    void moveChildrenTo(DNAChildren& dest)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            dest.m_slots[i] = m_slots[i];
+            m_slots[i] = 0;
+        }
+    }
+    template<typename Visit>
+    bool forEach(Visit visit, const SlabArena<NodeType>&) const // stops early, returning false, once visit does
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            if (m_slots[i] != 0 && !visit(m_slots[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+template<typename ValueType, template<typename> class ChildPolicy = LabelScanChildren>
 class Trie
 {
 public:
-    Trie();
+    // With compressPaths, a chain of single-child nodes is stored as one node
+    // whose edge carries the whole run of labels (a radix/Patricia trie).
+    Trie(bool compressPaths = false);
     ~Trie();
     void reset();
     void insert(const std::string& key, const ValueType& value);
+    void insert(const char* key, int keyLength, const ValueType& value);
+    // Unlinks every value of key itself for which remove(const ValueType&) is
+    // true, returning how many went; their slots are reused by later inserts.
+    // The nodes stay, so the rest of the trie is untouched.
+    template<typename Remove>
+    int removeValues(const char* key, int keyLength, Remove remove);
+    // Rebuilds the trie from the values for which keep(ValueType&) is true,
+    // after keep has had the chance to rewrite them. Everything is copied into
+    // fresh arenas, so nodes and edge labels no value needs any more (and the
+    // slots of removed values) are given back. Values keep their order.
+    template<typename Keep>
+    void compact(Keep keep);
     std::vector<ValueType> find(const std::string& key, bool exactMatchOnly) const;
-    
+    // Calls visit(const ValueType&) for each value find would return, in the same
+    // order, without copying them anywhere. visit returns false to stop the
+    // search, in which case find returns false too.
+    template<typename Visit>
+    bool find(const std::string& key, bool exactMatchOnly, Visit visit) const;
+    template<typename Visit>
+    bool find(const char* key, int keyLength, bool exactMatchOnly, Visit visit) const;
+    // The same search allowing up to maxMismatches (at most kMaxMismatches)
+    // differing labels after the first, which must still match exactly.
+    template<typename Visit>
+    bool findApproximate(const char* key, int keyLength, int maxMismatches, Visit visit) const;
+    static const int kMaxMismatches = 3;
+
+    // Batched lookup: the same results as calling find on each key, but keys
+    // are sorted so a shared prefix is walked once for all the keys that have
+    // it, and all walks advance together a level at a time, prefetching the
+    // nodes the next level will touch. visit(keyIndex, value) sees each key's
+    // values in the order find would give them (keys themselves interleave);
+    // it returns false to stop the whole batch.
+    struct KeyRef
+    {
+        const char* m_data;
+        int m_length;
+    };
+    std::vector<std::vector<ValueType>> findBatch(const std::vector<std::string>& keys, bool exactMatchOnly) const;
+    template<typename Visit>
+    bool findBatch(const std::vector<KeyRef>& keys, bool exactMatchOnly, Visit visit) const;
+
+    // Index images: save() writes the trie as one flat, pointer-free block that
+    // attach() can use in place, e.g. straight out of a memory-mapped file, with
+    // nothing rebuilt. The block must stay valid while the trie is attached; the
+    // next insert copies it into memory the trie owns. ValueType must be
+    // trivially copyable, and images only read back into the same build.
+    void save(std::ostream& out) const;
+    bool attach(const char* image, size_t size);
+
     // C++11 syntax for preventing copying and assignment
     Trie(const Trie&) = delete;
     Trie& operator=(const Trie&) = delete;
 private:
+    // Nodes and values live in slab arenas owned by the trie and refer to each
+    // other by id, so a node is trivially destructible and tearing the trie
+    // down is just releasing the chunks.
     struct Node
     {
-        char m_label;
-        std::vector<Node*> m_children;
-        std::vector<ValueType> m_values;
+        ChildPolicy<Node> m_children;
+        uint32_t m_firstValue = 0; // values at this node, as a list in the value arena (0 = none)
+        uint32_t m_lastValue = 0;
+        uint32_t m_labelStart = 0; // edge labels after the first, in m_edgeLabels
+        uint32_t m_labelLength = 1; // number of labels on the edge into this node
+        char m_label = 0; // first label on the edge; the one the parent's policy looks up
+    };
+    struct ValueSlot
+    {
+        ValueType m_value;
+        uint32_t m_next = 0;
+    };
+    static_assert(std::is_trivially_destructible<Node>::value, "trie nodes are released in bulk");
+
+    struct ImageHeader
+    {
+        uint32_t m_nodeCount;
+        uint32_t m_valueCount;
+        uint32_t m_labelCount;
+        uint32_t m_nodeSize;
+        uint32_t m_valueSize;
+        uint32_t m_compressPaths;
+        uint32_t m_reserved[2];
+    };
+
+    SlabArena<Node> m_nodes; // m_nodes[0] is the root
+    SlabArena<ValueSlot> m_values; // m_values[0] is unused so that 0 can mean "no value"
+    std::vector<char> m_edgeLabels;
+    const char* m_labels; // m_edgeLabels' data, or the attached image's labels
+    uint32_t m_labelCount;
+    bool m_compressPaths;
+    void initRoot();
+    void detach();
+    static size_t imageAlign(size_t bytes) { return (bytes + 7) & ~(size_t) 7; }
+    char edgeLabel(const Node& node, uint32_t i) const;
+    void split(uint32_t node, uint32_t length);
+    // Pending branches of a search: a node, where its edge starts in the key, and
+    // the mismatches still allowed. Kept in a fixed buffer that only spills to
+    // the heap for unusually long keys, so a search's stack use is bounded.
+    struct Branch
+    {
+        uint32_t m_node;
+        int m_index;
+        int m_mismatchesLeft;
+    };
+    struct BatchBranch // keys order[m_first, m_last) all share their first m_depth chars and are at the same place in the trie
+    {
+        int m_first;
+        int m_last;
+        int m_depth;
+        uint32_t m_node;
+        uint32_t m_edgeOffset; // labels of m_node's edge already matched
+        int m_mismatchesLeft;
+    };
+    class BranchStack
+    {
+    public:
+        BranchStack() : m_branches(m_local), m_size(0), m_capacity(kLocalBranches) {}
+        bool empty() const { return m_size == 0; }
+        int size() const { return m_size; }
+        Branch pop() { return m_branches[--m_size]; }
+        void push(const Branch& branch)
+        {
+            if (m_size == m_capacity)
+            {
+                if (m_branches == m_local)
+                {
+                    m_spill.assign(m_local, m_local + m_size);
+                }
+                m_spill.resize(m_capacity * 2);
+                m_branches = m_spill.data();
+                m_capacity *= 2;
+            }
+            m_branches[m_size++] = branch;
+        }
+        void reverseFrom(int first) { std::reverse(m_branches + first, m_branches + m_size); }
+    private:
+        static const int kLocalBranches = 256;
+        Branch m_local[kLocalBranches];
+        std::vector<Branch> m_spill;
+        Branch* m_branches;
+        int m_size;
+        int m_capacity;
     };
-    Node* root;
-    void freeTree(Node* curr);
-    void insertHelper(const std::string &key, const ValueType &value, int index, Node* curr);
-    void findHelper(const std::string& key, bool exactMatchOnly, int index, Node* curr, std::vector<ValueType> &totalValues) const;
 };
 
+// Trie specialized for nucleotide keys (A, C, G, T, N): O(1) child lookup per base.
 template<typename ValueType>
-Trie<ValueType>::Trie()
+using DNATrie = Trie<ValueType, DNAChildren>;
+
+template<typename ValueType, template<typename> class ChildPolicy>
+Trie<ValueType, ChildPolicy>::Trie(bool compressPaths)
 {
-    root = new Node;
+    m_compressPaths = compressPaths;
+    m_labels = nullptr;
+    m_labelCount = 0;
+    initRoot();
 }
 
-template<typename ValueType>
-Trie<ValueType>::~Trie()
+template<typename ValueType, template<typename> class ChildPolicy>
+Trie<ValueType, ChildPolicy>::~Trie()
 {
-    freeTree(root);
 }
 
-template<typename ValueType>
-void Trie<ValueType>::freeTree(Node* curr)
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::initRoot()
 {
-    if (curr == nullptr)
+    m_nodes.allocate(); // root
+    m_values.allocate(); // reserved "no value" slot
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::reset()
+{
+    m_nodes.clear();
+    m_values.clear();
+    m_edgeLabels.clear();
+    m_labels = nullptr;
+    m_labelCount = 0;
+    initRoot();
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::detach()
+{
+    if (!m_nodes.attached())
     {
         return;
     }
-    for (int i = 0; i < curr->m_children.size(); i++)
+    m_nodes.detach();
+    m_values.detach();
+    m_edgeLabels.assign(m_labels, m_labels + m_labelCount);
+    m_labels = m_edgeLabels.data();
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::save(std::ostream& out) const
+{
+    static const char padding[8] = { 0 };
+    ImageHeader header = ImageHeader();
+    header.m_nodeCount = m_nodes.size();
+    header.m_valueCount = m_values.size();
+    header.m_labelCount = m_labelCount;
+    header.m_nodeSize = sizeof(Node);
+    header.m_valueSize = sizeof(ValueSlot);
+    header.m_compressPaths = m_compressPaths;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_nodes.save(out);
+    out.write(padding, imageAlign(header.m_nodeCount * sizeof(Node)) - header.m_nodeCount * sizeof(Node));
+    m_values.save(out);
+    out.write(padding, imageAlign(header.m_valueCount * sizeof(ValueSlot)) - header.m_valueCount * sizeof(ValueSlot));
+    out.write(m_labels, m_labelCount);
+    out.write(padding, imageAlign(m_labelCount) - m_labelCount);
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+bool Trie<ValueType, ChildPolicy>::attach(const char* image, size_t size)
+{
+    ImageHeader header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    std::copy(image, image + sizeof(header), reinterpret_cast<char*>(&header));
+    size_t nodeBytes = imageAlign((size_t) header.m_nodeCount * sizeof(Node));
+    size_t valueBytes = imageAlign((size_t) header.m_valueCount * sizeof(ValueSlot));
+    if (header.m_nodeSize != sizeof(Node) || header.m_valueSize != sizeof(ValueSlot) || header.m_nodeCount == 0 || header.m_valueCount == 0 ||
+        size < sizeof(header) + nodeBytes + valueBytes + header.m_labelCount)
     {
-        freeTree(curr->m_children[i]);
+        return false; // written by a different build, or cut short
     }
-    delete curr;
+    const char* nodes = image + sizeof(header);
+    m_nodes.attach(reinterpret_cast<const Node*>(nodes), header.m_nodeCount);
+    m_values.attach(reinterpret_cast<const ValueSlot*>(nodes + nodeBytes), header.m_valueCount);
+    m_edgeLabels.clear();
+    m_labels = nodes + nodeBytes + valueBytes;
+    m_labelCount = header.m_labelCount;
+    m_compressPaths = header.m_compressPaths != 0;
+    return true;
 }
 
-template<typename ValueType>
-void Trie<ValueType>::reset()
+template<typename ValueType, template<typename> class ChildPolicy>
+char Trie<ValueType, ChildPolicy>::edgeLabel(const Node& node, uint32_t i) const
 {
-    freeTree(root);
-    root = new Node;
+    return i == 0 ? node.m_label : m_labels[node.m_labelStart + i - 1];
 }
 
-template<typename ValueType>
-void Trie<ValueType>::insert(const std::string &key, const ValueType &value)
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::split(uint32_t node, uint32_t length)
 {
-    insertHelper(key, value, 0, root);
+    // node keeps the first length labels of its edge; a new child takes the
+    // rest of the edge along with node's children and values
+    uint32_t lower = m_nodes.allocate();
+    Node& upper = m_nodes[node];
+    Node& rest = m_nodes[lower];
+    rest.m_label = edgeLabel(upper, length);
+    rest.m_labelStart = upper.m_labelStart + length;
+    rest.m_labelLength = upper.m_labelLength - length;
+    upper.m_children.moveChildrenTo(rest.m_children);
+    rest.m_firstValue = upper.m_firstValue;
+    rest.m_lastValue = upper.m_lastValue;
+    upper.m_firstValue = 0;
+    upper.m_lastValue = 0;
+    upper.m_labelLength = length;
+    upper.m_children.addChild(rest.m_label, lower, m_nodes);
 }
 
-template<typename ValueType>
-void Trie<ValueType>::insertHelper(const std::string &key, const ValueType &value, int index, Node* curr)
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::insert(const std::string &key, const ValueType &value)
+{
+    insert(key.c_str(), (int) key.size(), value);
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+void Trie<ValueType, ChildPolicy>::insert(const char* key, int keyLength, const ValueType &value)
 {
-    if (index >= key.size()) // if we reach the end of the key string we add the value to the vector
+    detach(); // an attached image is read-only
+    uint32_t curr = 0;
+    int index = 0;
+    while (index < keyLength)
     {
-        curr->m_values.push_back(value);
-        return;
+        uint32_t next = m_nodes[curr].m_children.child(key[index], m_nodes);
+        if (next == 0)
+        {
+            // if we don't find the character we create a node for that character as its label and continue
+            if (m_compressPaths) // the new node's edge will take the rest of the key, so all of it must be storable
+            {
+                for (int i = index + 1; i < keyLength; i++)
+                {
+                    if (!ChildPolicy<Node>::canHold(key[i]))
+                    {
+                        return;
+                    }
+                }
+            }
+            next = m_nodes.allocate();
+            Node& leaf = m_nodes[next];
+            leaf.m_label = key[index];
+            if (m_compressPaths)
+            {
+                leaf.m_labelStart = (uint32_t) m_edgeLabels.size();
+                leaf.m_labelLength = (uint32_t) (keyLength - index);
+                m_edgeLabels.insert(m_edgeLabels.end(), key + index + 1, key + keyLength);
+                m_labels = m_edgeLabels.data();
+                m_labelCount = (uint32_t) m_edgeLabels.size();
+            }
+            if (!m_nodes[curr].m_children.addChild(key[index], next, m_nodes)) // the policy can't hold this label
+            {
+                return; // the node stays unreferenced until the arena is released
+            }
+            curr = next;
+            index += leaf.m_labelLength;
+            continue;
+        }
+
+        // follow the child's edge as far as the key agrees with it
+        const Node& child = m_nodes[next];
+        uint32_t matched = 1;
+        while (matched < child.m_labelLength && index + matched < keyLength && edgeLabel(child, matched) == key[index + matched])
+        {
+            matched++;
+        }
+        if (matched < child.m_labelLength) // the key leaves (or ends inside) the edge, so it needs a node there
+        {
+            split(next, matched);
+        }
+        curr = next;
+        index += matched;
+    }
+
+    // we reached the end of the key string so we add the value to this node's list
+    uint32_t v = m_values.allocate();
+    m_values[v].m_value = value;
+    Node& node = m_nodes[curr];
+    if (node.m_lastValue == 0)
+    {
+        node.m_firstValue = v;
+    }
+    else
+    {
+        m_values[node.m_lastValue].m_next = v;
+    }
+    node.m_lastValue = v;
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Remove>
+int Trie<ValueType, ChildPolicy>::removeValues(const char* key, int keyLength, Remove remove)
+{
+    // find key's own node, following edges only where all their labels match
+    uint32_t curr = 0;
+    int index = 0;
+    while (index < keyLength)
+    {
+        uint32_t next = m_nodes[curr].m_children.child(key[index], m_nodes);
+        if (next == 0 || index + (int) m_nodes[next].m_labelLength > keyLength)
+        {
+            return 0;
+        }
+        const Node& child = m_nodes[next];
+        for (uint32_t i = 1; i < child.m_labelLength; i++)
+        {
+            if (edgeLabel(child, i) != key[index + i])
+            {
+                return 0;
+            }
+        }
+        curr = next;
+        index += child.m_labelLength;
     }
     
-    for(int i = 0; i < curr->m_children.size(); i++)
+    int removed = 0;
+    uint32_t previous = 0;
+    for (uint32_t v = m_nodes[curr].m_firstValue; v != 0; )
+    {
+        uint32_t next = m_values[v].m_next;
+        if (!remove(static_cast<const ValueType&>(m_values[v].m_value)))
+        {
+            previous = v;
+            v = next;
+            continue;
+        }
+        detach(); // an attached image is read-only
+        Node& node = m_nodes[curr];
+        if (previous == 0)
+        {
+            node.m_firstValue = next;
+        }
+        else
+        {
+            m_values[previous].m_next = next;
+        }
+        if (node.m_lastValue == v)
+        {
+            node.m_lastValue = previous;
+        }
+        m_values[v].m_next = 0;
+        m_values.release(v);
+        removed++;
+        v = next;
+    }
+    return removed;
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Keep>
+void Trie<ValueType, ChildPolicy>::compact(Keep keep)
+{
+    // walk the trie depth first, children in order, inserting each kept value
+    // under its key into a new trie, which then takes this one's place
+    Trie fresh(m_compressPaths);
+    std::string key;
+    std::vector<std::pair<uint32_t, int>> pending(1, std::make_pair(0u, 0)); // a node and the length of the key above its edge
+    std::vector<uint32_t> children;
+    while (!pending.empty())
     {
-        if (curr->m_children[i]->m_label == key[index])
+        uint32_t curr = pending.back().first;
+        key.resize(pending.back().second);
+        pending.pop_back();
+        const Node& node = m_nodes[curr];
+        for (uint32_t i = 0; curr != 0 && i < node.m_labelLength; i++)
+        {
+            key += edgeLabel(node, i);
+        }
+        for (uint32_t v = node.m_firstValue; v != 0; v = m_values[v].m_next)
+        {
+            ValueType value = m_values[v].m_value;
+            if (keep(value))
+            {
+                fresh.insert(key.data(), (int) key.size(), value);
+            }
+        }
+        children.clear();
+        node.m_children.forEach([&children](uint32_t child)
         {
-            index++; // looking at the next character in the key
-            insertHelper(key, value, index, curr->m_children[i]); // looking through it's child now
-            return;
+            children.push_back(child);
+            return true;
+        }, m_nodes);
+        for (int c = (int) children.size() - 1; c >= 0; c--)
+        {
+            pending.push_back(std::make_pair(children[c], (int) key.size()));
         }
     }
-    // if we finish the loop and dont find the character we create a node for that character as its label and continue
-    Node* inserting;
-    inserting = new Node;
-    inserting->m_label = key[index];
-    curr->m_children.push_back(inserting); // adding inserting to curr's children
-    index++;
-    insertHelper(key, value, index, inserting); // call the reccursive function so that it gets to this point and adds the remaining necessary chars
+    m_nodes.swap(fresh.m_nodes);
+    m_values.swap(fresh.m_values);
+    m_edgeLabels.swap(fresh.m_edgeLabels);
+    m_labels = m_edgeLabels.data();
+    m_labelCount = (uint32_t) m_edgeLabels.size();
 }
 
-template<typename ValueType>
-std::vector<ValueType> Trie<ValueType>::find(const std::string& key, bool exactMatchOnly) const
+template<typename ValueType, template<typename> class ChildPolicy>
+std::vector<ValueType> Trie<ValueType, ChildPolicy>::find(const std::string& key, bool exactMatchOnly) const
 {
     std::vector<ValueType> totalValues = std::vector<ValueType>(); // initialize as the empty vector
-    for (int i = 0; i < root->m_children.size(); i++)
+    find(key, exactMatchOnly, [&totalValues](const ValueType& value)
     {
-        if (root->m_children[i]->m_label == key[0]) // looking for the the first char of key in root's children; only if one of the childs of the root has the first char of key do we proceed (otherwise, we return the empty vector)
+        totalValues.push_back(value);
+        return true;
+    });
+    return totalValues;
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Visit>
+bool Trie<ValueType, ChildPolicy>::find(const std::string& key, bool exactMatchOnly, Visit visit) const
+{
+    return find(key.c_str(), (int) key.size(), exactMatchOnly, visit);
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Visit>
+bool Trie<ValueType, ChildPolicy>::find(const char* key, int keyLength, bool exactMatchOnly, Visit visit) const
+{
+    return findApproximate(key, keyLength, exactMatchOnly ? 0 : 1, visit);
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Visit>
+bool Trie<ValueType, ChildPolicy>::findApproximate(const char* key, int keyLength, int maxMismatches, Visit visit) const
+{
+    if (keyLength == 0)
+    {
+        return true;
+    }
+    uint32_t first = m_nodes[0].m_children.child(key[0], m_nodes); // the first char of key must match one of root's children exactly (otherwise, we find nothing)
+    if (first == 0)
+    {
+        return true;
+    }
+
+    // depth-first search with an explicit stack; branches are taken in child
+    // order so values come out in the same order as a recursive walk
+    BranchStack pending;
+    pending.push({ first, 0, maxMismatches < kMaxMismatches ? maxMismatches : kMaxMismatches });
+    while (!pending.empty())
+    {
+        Branch branch = pending.pop();
+        uint32_t curr = branch.m_node;
+        int index = branch.m_index; // where curr's edge starts in the key
+        int mismatchesLeft = branch.m_mismatchesLeft;
+        for (;;)
         {
-            findHelper(key, exactMatchOnly, 1, root->m_children[i], totalValues); // we search deeper
+            // walk curr's edge, spending a mismatch (SNip) on each label that differs from the key
+            const Node& node = m_nodes[curr];
+            if (index + node.m_labelLength > keyLength) // the key ends inside the edge, so no stored key equals it
+            {
+                break;
+            }
+            uint32_t i = 0;
+            for (; i < node.m_labelLength; i++, index++)
+            {
+                if (edgeLabel(node, i) != key[index] && --mismatchesLeft < 0)
+                {
+                    break;
+                }
+            }
+            if (i < node.m_labelLength) // out of mismatches: prune this branch
+            {
+                break;
+            }
+
+            if (index == keyLength)
+            {
+                for (uint32_t v = node.m_firstValue; v != 0; v = m_values[v].m_next)
+                {
+                    if (!visit(static_cast<const ValueType&>(m_values[v].m_value)))
+                    {
+                        return false;
+                    }
+                }
+                break;
+            }
+
+            if (mismatchesLeft == 0) // only the child labeled with the key's char can continue the match
+            {
+                curr = node.m_children.child(key[index], m_nodes);
+                if (curr == 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            // any child may continue the match; a differing first label is charged when its edge is walked
+            int firstPushed = pending.size();
+            node.m_children.forEach([&](uint32_t child)
+            {
+                pending.push({ child, index, mismatchesLeft });
+                return true;
+            }, m_nodes);
+            pending.reverseFrom(firstPushed);
+            break;
         }
     }
-    return totalValues; 
+    return true;
 }
 
-template<typename ValueType>
-void Trie<ValueType>::findHelper(const std::string& key, bool exactMatchOnly, int index, Node* curr, std::vector<ValueType>& totalValues) const // if we call this function, it ensures that the first char of the key is found
+
+
+template<typename ValueType, template<typename> class ChildPolicy>
+std::vector<std::vector<ValueType>> Trie<ValueType, ChildPolicy>::findBatch(const std::vector<std::string>& keys, bool exactMatchOnly) const
 {
-    
-    if (key.size() == index)
+    std::vector<KeyRef> refs(keys.size());
+    for (int i = 0; i < keys.size(); i++)
     {
-        totalValues.insert(totalValues.end(), curr->m_values.begin(), curr->m_values.end()); // and snips? 
-        return;
+        refs[i].m_data = keys[i].c_str();
+        refs[i].m_length = (int) keys[i].size();
     }
-    
-    for (int i = 0; i < curr->m_children.size(); i++)
+    std::vector<std::vector<ValueType>> totalValues(keys.size());
+    findBatch(refs, exactMatchOnly, [&totalValues](int key, const ValueType& value)
     {
-        if (curr->m_children[i]->m_label == key[index]) // if the child matches the key we are looking for
+        totalValues[key].push_back(value);
+        return true;
+    });
+    return totalValues;
+}
+
+template<typename ValueType, template<typename> class ChildPolicy>
+template<typename Visit>
+bool Trie<ValueType, ChildPolicy>::findBatch(const std::vector<KeyRef>& keys, bool exactMatchOnly, Visit visit) const
+{
+    // sort the (non-empty) keys so keys sharing a prefix sit next to each other
+    std::vector<int> order;
+    order.reserve(keys.size());
+    for (int i = 0; i < keys.size(); i++)
+    {
+        if (keys[i].m_length > 0) // like find, an empty key matches nothing
         {
-            findHelper(key, exactMatchOnly, index + 1, curr->m_children[i], totalValues); // look through the child
+            order.push_back(i);
         }
-        else if(curr->m_children[i]->m_label != key[index] && !exactMatchOnly) // allowing only one mismatch (SNip)
+    }
+    std::sort(order.begin(), order.end(), [&keys](int x, int y)
+    {
+        int common = std::min(keys[x].m_length, keys[y].m_length);
+        int c = std::memcmp(keys[x].m_data, keys[y].m_data, common);
+        return c != 0 ? c < 0 : keys[x].m_length < keys[y].m_length;
+    });
+
+    // Breadth-first over key positions. Each branch is a run of keys with an
+    // identical prefix at one trie position, so the prefix is matched once for
+    // the run. A level's branches are kept in trie (child) order, which keeps
+    // each key's values in the order a depth-first find reports them.
+    std::vector<BatchBranch> level;
+    std::vector<BatchBranch> nextLevel;
+    if (!order.empty())
+    {
+        level.push_back({ 0, (int) order.size(), 0, 0, m_nodes[0].m_labelLength, exactMatchOnly ? 0 : 1 });
+    }
+    const int kPrefetchAhead = 8;
+    while (!level.empty())
+    {
+        nextLevel.clear();
+        for (int b = 0; b < level.size(); b++)
         {
-            findHelper(key, true, index + 1, curr->m_children[i], totalValues); // continue to search but no more mismatches
+            if (b + kPrefetchAhead < level.size())
+            {
+#if defined(__GNUC__) || defined(__clang__)
+                __builtin_prefetch(&m_nodes[level[b + kPrefetchAhead].m_node]);
+#endif
+            }
+            BatchBranch branch = level[b];
+            const Node& node = m_nodes[branch.m_node];
+            const int d = branch.m_depth;
+
+            // keys that end here come first in the run (they are the shortest)
+            while (branch.m_first < branch.m_last && keys[order[branch.m_first]].m_length == d)
+            {
+                if (d > 0 && branch.m_edgeOffset == node.m_labelLength) // a key ending inside an edge matches nothing
+                {
+                    for (uint32_t v = node.m_firstValue; v != 0; v = m_values[v].m_next)
+                    {
+                        if (!visit(order[branch.m_first], static_cast<const ValueType&>(m_values[v].m_value)))
+                        {
+                            return false;
+                        }
+                    }
+                }
+                branch.m_first++;
+            }
+
+            // split the rest into runs by their next char and send each run down
+            // every way its budget allows; the first char must match exactly
+            auto descend = [&](char label, uint32_t to, uint32_t edgeOffset)
+            {
+                for (int first = branch.m_first; first < branch.m_last; )
+                {
+                    char c = keys[order[first]].m_data[d];
+                    int last = first + 1;
+                    while (last < branch.m_last && keys[order[last]].m_data[d] == c)
+                    {
+                        last++;
+                    }
+                    if (c == label)
+                    {
+                        nextLevel.push_back({ first, last, d + 1, to, edgeOffset, branch.m_mismatchesLeft });
+                    }
+                    else if (branch.m_mismatchesLeft > 0 && d > 0)
+                    {
+                        nextLevel.push_back({ first, last, d + 1, to, edgeOffset, branch.m_mismatchesLeft - 1 });
+                    }
+                    first = last;
+                }
+            };
+            if (branch.m_first == branch.m_last)
+            {
+                continue;
+            }
+            if (branch.m_edgeOffset < node.m_labelLength) // still inside this node's edge
+            {
+                descend(edgeLabel(node, branch.m_edgeOffset), branch.m_node, branch.m_edgeOffset + 1);
+            }
+            else if (branch.m_mismatchesLeft == 0 || d == 0) // only children labeled with a key's next char can continue
+            {
+                for (int first = branch.m_first; first < branch.m_last; )
+                {
+                    char c = keys[order[first]].m_data[d];
+                    int last = first + 1;
+                    while (last < branch.m_last && keys[order[last]].m_data[d] == c)
+                    {
+                        last++;
+                    }
+                    uint32_t child = node.m_children.child(c, m_nodes);
+                    if (child != 0)
+                    {
+                        nextLevel.push_back({ first, last, d + 1, child, 1, branch.m_mismatchesLeft });
+                    }
+                    first = last;
+                }
+            }
+            else
+            {
+                node.m_children.forEach([&](uint32_t child)
+                {
+                    descend(m_nodes[child].m_label, child, 1);
+                    return true;
+                }, m_nodes);
+            }
         }
+        level.swap(nextLevel);
     }
-    return;
+    return true;
 }
 
 
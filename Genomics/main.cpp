@@ -175,6 +175,7 @@
 #include <vector>
 #include <cctype>
 #include <cstdlib>
+#include <thread>
 using namespace std;
 
 // Change the string literal in this declaration to be the path to the
@@ -266,23 +267,86 @@ void loadOneDataFile(GenomeMatcher* library)
     vector<Genome> genomes;
     if (!loadFile(filename, genomes))
         return;
-    for (const auto& g : genomes)
-        library->addGenome(g);
+    library->addGenomes(genomes, thread::hardware_concurrency());
     cout << "Successfully loaded " << genomes.size() << " genomes." << endl;
 }
 
 void loadProvidedFiles(GenomeMatcher* library)
 {
+    vector<string> filenames;
     for (const string& f : providedFiles)
+        filenames.push_back(PROVIDED_DIR + "/" + f);
+    vector<LoadedFile> results;
+    library->loadFiles(filenames, thread::hardware_concurrency(), results);
+    for (int i = 0; i < results.size(); i++)
     {
-        vector<Genome> genomes;
-        if (loadFile(PROVIDED_DIR + "/" + f, genomes))
-        {
-            for (const auto& g : genomes)
-                library->addGenome(g);
-            cout << "Loaded " << genomes.size() << " genomes from " << f << endl;
-        }
+        if (!results[i].opened)
+            cout << "Cannot open file: " << results[i].filename << endl;
+        else if (!results[i].loaded)
+            cout << "Improperly formatted file: " << results[i].filename << endl;
+        else
+            cout << "Loaded " << results[i].genomeCount << " genomes from " << providedFiles[i] << endl;
+    }
+}
+
+void saveLibraryIndex(GenomeMatcher* library)
+{
+    string filename;
+    cout << "Enter index file name: ";
+    getline(cin, filename);
+    if (filename.empty())
+    {
+        cout << "No file name entered." << endl;
+        return;
+    }
+    if (!library->saveIndex(filename))
+    {
+        cout << "Cannot write index file: " << filename << endl;
+        return;
     }
+    cout << "Saved library index to " << filename << endl;
+}
+
+void openLibraryIndex(GenomeMatcher* library)
+{
+    string filename;
+    cout << "Enter index file name: ";
+    getline(cin, filename);
+    if (filename.empty())
+    {
+        cout << "No file name entered." << endl;
+        return;
+    }
+    if (!library->openIndex(filename))
+    {
+        cout << "Cannot open index file: " << filename << endl;
+        return;
+    }
+    cout << "Opened library index with minSearchLength " << library->minimumSearchLength() << endl;
+}
+
+void removeGenomeManually(GenomeMatcher* library)
+{
+    cout << "Enter name: ";
+    string name;
+    getline(cin, name);
+    if (name.empty())
+    {
+        cout << "Name must not be empty." << endl;
+        return;
+    }
+    if (!library->removeGenome(name))
+    {
+        cout << "No genome is named " << name << endl;
+        return;
+    }
+    cout << "Removed " << name << endl;
+}
+
+void compactLibrary(GenomeMatcher* library)
+{
+    library->compact();
+    cout << "Library compacted" << endl;
 }
 
 void findGenome(GenomeMatcher* library, bool exactMatch)
@@ -368,7 +432,7 @@ void findRelatedGenomesManual(GenomeMatcher* library)
         return;
     
     vector<GenomeMatch> matches;
-    library->findRelatedGenomes(Genome("x", sequence), 2 * minLength, exactMatchOnly, pctThreshold, matches);
+    library->findRelatedGenomes(Genome("x", sequence), 2 * minLength, exactMatchOnly, pctThreshold, matches, thread::hardware_concurrency());
     if (matches.empty())
     {
         cout << "    No related genomes were found" << endl;
@@ -403,7 +467,7 @@ void findRelatedGenomesFromFile(GenomeMatcher* library)
     for (const auto& g : genomes)
     {
         vector<GenomeMatch> matches;
-        library->findRelatedGenomes(g, 2 * minLength, exactMatchOnly, pctThreshold, matches);
+        library->findRelatedGenomes(g, 2 * minLength, exactMatchOnly, pctThreshold, matches, thread::hardware_concurrency());
         cout << "  For " << g.name() << endl;
         if (matches.empty())
         {
@@ -426,6 +490,8 @@ void showMenu()
     cout << "         l - load one data file             f - find related genomes (file)" << endl;
     cout << "         d - load all provided data files   ? - show this menu" << endl;
     cout << "         e - find matches exactly           q - quit" << endl;
+    cout << "         w - write library index            o - open library index" << endl;
+    cout << "         x - remove a genome                k - compact the library" << endl;
 }
 
 int main()
@@ -481,6 +547,18 @@ int main()
             case 'f':
                 findRelatedGenomesFromFile(library);
                 break;
+            case 'w':
+                saveLibraryIndex(library);
+                break;
+            case 'o':
+                openLibraryIndex(library);
+                break;
+            case 'x':
+                removeGenomeManually(library);
+                break;
+            case 'k':
+                compactLibrary(library);
+                break;
         }
     }
 }
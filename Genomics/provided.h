@@ -12,23 +12,68 @@
 #include <string>
 #include <vector>
 #include <istream>
+#include <ostream>
+#include <cstdint>
+#include <memory>
 
 class GenomeImpl;
+class MappedFile;
+
+// A read-only window onto part of a Genome's packed sequence. Nothing is
+// copied, so a view is only good while the Genome it came from (or a copy
+// of it) is alive.
+class GenomeView
+{
+public:
+    GenomeView();
+    int length() const;
+    uint64_t packedWord(int position) const; // as Genome::packedWord, but 0 past the view's end
+    bool containsN(int position, int length) const;
+private:
+    friend class Genome;
+    const GenomeImpl* m_genome;
+    int m_position;
+    int m_length;
+};
 
 class Genome
 {
 public:
     Genome(const std::string& nm, const std::string& sequence);
     ~Genome();
+    // Copies share the same immutable sequence, so copying a Genome never
+    // copies its bases. A moved-from Genome may only be assigned or destroyed.
     Genome(const Genome& other);
     Genome& operator=(const Genome& rhs);
+    Genome(Genome&& other) noexcept;
+    Genome& operator=(Genome&& rhs) noexcept;
     static bool load(std::istream& genomeSource, std::vector<Genome>& genomes);
+    // Like load, but the file is memory-mapped and described by a .fai-style
+    // index kept next to it (made the first time), so a genome's bases are
+    // only read from the file when they're asked for. A file whose lines
+    // aren't laid out evenly is just loaded.
+    static bool loadIndexed(const std::string& filename, std::vector<Genome>& genomes);
+    // A genome's packed words and runs of other bases as an index image holds
+    // them: saveImage writes imageSize() bytes (a multiple of 8), and
+    // attachImage adds the genome saved at offset to genomes, reading its
+    // bases from the image in place. It fails if they don't fit length.
+    size_t imageSize() const;
+    void saveImage(std::ostream& out) const;
+    static bool attachImage(const std::string& nm, int length, const std::shared_ptr<const MappedFile>& image, size_t offset, size_t size, std::vector<Genome>& genomes);
     int length() const;
     std::string name() const;
     bool extract(int position, int length, std::string& fragment) const;
+    // The sequence packed 2 bits per base (A=0, C=1, G=2, T=3), 32 bases to a
+    // word with the first base in the low bits. Anything else (usually N)
+    // packs as A, so check containsN before trusting a word there.
+    uint64_t packedWord(int position) const; // the 32 bases from position on; 0 past the end
+    bool containsN(int position, int length) const;
+    bool view(int position, int length, GenomeView& fragment) const; // extract without the copy
     
 private:
-    GenomeImpl* m_impl;
+    friend class GenomeImpl;
+    Genome(std::shared_ptr<const GenomeImpl> impl);
+    std::shared_ptr<const GenomeImpl> m_impl;
 };
 
 struct DNAMatch
@@ -36,6 +81,7 @@ struct DNAMatch
     std::string genomeName;
     int length;
     int position;
+    bool reverseStrand; // the fragment matched the reverse complement of the genome's bases [position, position + length)
 };
 
 struct GenomeMatch
@@ -44,17 +90,96 @@ struct GenomeMatch
     double percentMatch;
 };
 
+struct LoadedFile
+{
+    std::string filename;
+    bool opened;     // false if the file couldn't be opened
+    bool loaded;     // false if it was improperly formatted; nothing from it is added then
+    int genomeCount;
+};
+
+// Bounds on the work one search does. A search stopped by maxHits or
+// maxMilliseconds gives the best matches among the hits it got to.
+struct SearchLimits
+{
+    int maxMatches = 0;        // report only the longest this many, ties going to the first found; 0 for all
+    long long maxHits = 0;     // look at no more than this many seed hits; 0 for no limit
+    int maxMilliseconds = 0;   // stop looking at hits after about this long; 0 for no limit
+};
+
+// Where a GenomeMatcher looks up the first minSearchLength bases of a fragment.
+enum class SeedIndex
+{
+    KmerTrie, // a trie of every k-mer: the fastest to search, but many bytes per base
+    FMIndex,  // an FM-index of the genomes: a few bits per base; it's built on the
+              // first search, and genomes added after that are kept in k-mer tries
+              // beside it until compact(). Only A, C, G, T and N can match.
+    KmerHash  // a hash table of every k-mer packed 2 bits a base: exact seeds take
+              // one probe; built like FMIndex. A KmerTrie if minSearchLength > 32.
+};
+
 class GenomeMatcherImpl;
 
 class GenomeMatcher
 {
 public:
-    GenomeMatcher(int minSearchLength);
+    // With a minimizerWindow above 1, a KmerTrie only indexes the k-mer that
+    // hashes smallest in each run of that many, about 2/(minimizerWindow+1) of
+    // them. Those answer searches for exact matches at least
+    // minSearchLength+minimizerWindow-1 long whose first window has a k-mer
+    // without an N; any other search falls back to an FM-index of the
+    // genomes, built when first needed. Either way the matches are the same
+    // as an unsampled index gives.
+    // With bothStrands, searches also find fragments on the genomes' reverse
+    // strands, from the same size of index: each k-mer is indexed once, as
+    // whichever of it and its reverse complement comes first. A genome's best
+    // match may then be on either strand. minimizerWindow is ignored.
+    GenomeMatcher(int minSearchLength, SeedIndex seedIndex = SeedIndex::KmerTrie, int minimizerWindow = 1, bool bothStrands = false);
     ~GenomeMatcher();
     void addGenome(const Genome& genome);
+    // Adds the genomes in order, building their part of the index on up to
+    // threads threads. The result is the same as calling addGenome on each.
+    void addGenomes(const std::vector<Genome>& genomes, int threads);
+    // Loads each file (as Genome::load does) and adds its genomes, in file
+    // order. Files are parsed while the ones already parsed are being
+    // indexed, the two sharing up to threads threads between them. results
+    // gets one LoadedFile per file.
+    void loadFiles(const std::vector<std::string>& filenames, int threads, std::vector<LoadedFile>& results);
+    // removeGenome takes every genome with that name out of the library,
+    // returning false if there were none; replaceGenome removes the genome's
+    // name and adds it anew. Removed genomes stop matching at once, but
+    // their bases and seeds are only given back by compact(), which also
+    // folds genomes added since an FMIndex or KmerHash was built into it.
+    bool removeGenome(const std::string& name);
+    bool replaceGenome(const Genome& genome);
+    void compact();
     int minimumSearchLength() const;
+    // When several positions in a genome tie for the longest match, the one
+    // reported is the first reached walking the seeds' bases in A, C, G, T, N
+    // order (then in the order the genomes were added), not necessarily the
+    // first in the genome.
     bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, std::vector<DNAMatch>& matches) const;
-    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results) const;
+    // With limits, a search also stops as soon as maxMatches genomes (or all
+    // of them) have matches as long as the fragment, which nothing can beat.
+    bool findGenomesWithThisDNA(const std::string& fragment, int minimumLength, bool exactMatchOnly, const SearchLimits& limits, std::vector<DNAMatch>& matches) const;
+    // findGenomesWithThisDNA for many fragments: results[i] gets fragments[i]'s
+    // matches (empty if it has none). Fragments with seeds in common share the
+    // lookups, and the work is spread over up to threads threads.
+    void findGenomesWithThisDNABatch(const std::vector<std::string>& fragments, int minimumLength, bool exactMatchOnly, int threads, std::vector<std::vector<DNAMatch>>& results) const;
+    // A window of fragmentMatchLength bases is slid along the query, stride
+    // bases at a time (fragmentMatchLength, so the windows don't overlap, if
+    // stride isn't positive); a genome's percentMatch is the share of the
+    // windows it has a match for. A smaller stride gives a finer score.
+    // Results come most related first, then by name. Windows are matched on
+    // up to threads threads; the results don't depend on how many.
+    bool findRelatedGenomes(const Genome& query, int fragmentMatchLength, bool exactMatchOnly, double matchPercentThreshold, std::vector<GenomeMatch>& results, int threads = 1, int stride = 0) const;
+    // Saves the genomes and their seed index as a flat binary image. openIndex
+    // replaces the library (minimum search length and kind of seed index
+    // included) with a saved one, memory-mapping it so queries can start
+    // without rebuilding the index. Saving over the image a library has open
+    // is fine; the file is only replaced once the new image is complete.
+    bool saveIndex(const std::string& filename) const;
+    bool openIndex(const std::string& filename);
     // We prevent a GenomeMatcher object from being copied or assigned.
     GenomeMatcher(const GenomeMatcher&) = delete;
     GenomeMatcher& operator=(const GenomeMatcher&) = delete;